@@ -0,0 +1,148 @@
+/**
+ * benchmarks of the prompt internals, built with `make bench`.
+ * main.c is included whole so its static functions can be called directly.
+ */
+#define LIBRMSH
+#include "main.c"
+
+#include <time.h>
+
+#define BENCH_SZ   (1 << 20)
+#define BENCH_RUNS 200
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * fills `buf` with copies of `s` up to `n` bytes, cut on a character boundary.
+ * returns the amount of bytes filled.
+ */
+static size_t bench_fill(char *buf, size_t n, const char *s)
+{
+    size_t len = strlen(s), i = 0;
+    while (i + len <= n) {
+        memcpy(buf + i, s, len);
+        i += len;
+    }
+    return i;
+}
+
+static void bench_width(const char *name, const char *s)
+{
+    static char buf[BENCH_SZ];
+    size_t n = bench_fill(buf, sizeof(buf), s), cols = 0;
+
+    double start = bench_now();
+    for (int i = 0; i < BENCH_RUNS; i++)
+        cols += utf8_width(buf, n);
+    double secs = bench_now() - start;
+
+    printf("utf8_width %-8s %8.1f MB/s (%zu columns)\n", name, (double)n * BENCH_RUNS / secs / 1e6, cols / BENCH_RUNS);
+}
+
+static void bench_keys(const char *name, const char *s)
+{
+    static char buf[BENCH_SZ];
+    size_t n = bench_fill(buf, sizeof(buf), s), keys = 0;
+    struct __termchar termchar;
+
+    double start = bench_now();
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        memset(&termchar, 0, sizeof(termchar));
+        for (size_t j = 0; j < n; j++) {
+            int ret = __termchar_input(&termchar, buf[j]);
+            if (!ret)
+                continue;
+            keys += (ret == 1);
+            memset(&termchar, 0, sizeof(termchar));
+        }
+    }
+    double secs = bench_now() - start;
+
+    printf("__termchar_input %-8s %8.1f Mkeys/s\n", name, keys / secs / 1e6);
+}
+
+/**
+ * looks up bound keys with `extra` more bindings loaded, the cost shouldn't grow with them.
+ */
+static void bench_keymap(size_t extra)
+{
+    static size_t loaded;
+    char seq[32];
+    uint32_t keys[PRMT_KEYSEQ_MAX];
+    size_t found = 0;
+
+    prompt_keymap_init();
+    for (; loaded < extra; loaded++) {
+        snprintf(seq, sizeof(seq), "\\C-x%zu", loaded);
+        prompt_keymap_bind(seq, 1);
+    }
+
+    prompt_keyseq("\\e[D", keys);
+    double start = bench_now();
+    for (int i = 0; i < BENCH_RUNS * 100000; i++)
+        found += !!prompt_keymap_find(0, keys[0] + (i & 1));
+    double secs = bench_now() - start;
+
+    printf("prompt_keymap_find %6zu bindings %8.1f Mlookups/s (%zu found)\n",
+           prompt_keymap.n, BENCH_RUNS * 100000 / secs / 1e6, found);
+}
+
+/**
+ * replays `s` repeated up to `n` bytes through the line editor on a 24x80 virtual terminal,
+ * like `rmsh -p` does a recording.
+ */
+static void bench_replay(const char *name, const char *s, size_t n)
+{
+    static char buf[BENCH_SZ];
+    struct prompt prmt = {0};
+    struct vt vt;
+    int fd = open("/dev/null", O_WRONLY);
+
+    n = bench_fill(buf, n, s);
+    memset(&prompt_stat, 0, sizeof(prompt_stat));
+    vt_open(&vt, 24, 80);
+    ssize_t bad = prompt_replay(&prmt, "$ ", &vt, (unsigned char *)buf, n, fd);
+    vt_close(&vt);
+    close(fd);
+    __prompt_reset(&prmt, NULL);
+
+    size_t keys = (prompt_stat.keys ? prompt_stat.keys : 1), frames = (prompt_stat.frames ? prompt_stat.frames : 1);
+    printf("prompt_replay %-8s %8.0f ns/key %6.1f bytes/frame p99 %6.1f us, %zd bad frames\n", name,
+           (double)prompt_stat.latency.sum / keys, (double)prompt_stat.bytes / frames,
+           prompt_hist_quantile(&prompt_stat.latency, 0.99) / 1e3, bad);
+}
+
+int main(void)
+{
+    static char tall[4096];
+    size_t len;
+
+    bench_width("ascii", "the quick brown fox jumps over the lazy dog ");
+    bench_width("cjk", "\xe6\xbc\xa2\xe5\xad\x97\xe3\x81\x8b\xe3\x81\xaa\xed\x95\x9c\xea\xb8\x80");
+    bench_width("mixed", "ls -la caf\x65\xcc\x81 \xe6\xbc\xa2\xe5\xad\x97 \xf0\x9f\x98\x80 | grep x ");
+
+    bench_keys("text", "echo hello world | wc -c");
+    bench_keys("utf8", "\xe6\xbc\xa2\xe5\xad\x97 caf\xc3\xa9 \xf0\x9f\x98\x80");
+    bench_keys("csi", "\e[A\e[1;5C\e[3~\e[200~\eOH\e[15;2~\ex");
+
+    bench_replay("typing", "echo hello world | wc -c\n", 1 << 16);
+    bench_replay("editing", "git commit -m 'fix'\e[D\e[D\x7f\x01\e[1;5C\x05 x\n", 1 << 16);
+    bench_replay("history", "ls -la /tmp\n\e[A\e[A\e[A\e[B\x05!\n", 1 << 16);
+    bench_replay("longline", "abcdefgh ", 1 << 14);
+
+    // a pasted line taller than the screen, edited at both ends
+    len = strlen(strcpy(tall, "\e[200~"));
+    len += bench_fill(tall + len, 3000, "abcdefgh ");
+    strcpy(tall + len, "\e[201~\x01xy\x05\x7f\x7fz\n");
+    bench_replay("tall", tall, 1 << 16);
+
+    bench_keymap(0);
+    bench_keymap(1000);
+    bench_keymap(100000);
+    return 0;
+}
@@ -1,17 +1,32 @@
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 #include <locale.h>
 #include <termios.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "wcwidth.h"
 
 #define ASSERT(Condition) do { if (!(Condition)) { perror(Error); exit(1); } } while (0)
 #define ASSERT_PERROR(Condition, Error) do { if (!(Condition)) { perror(Error); goto out; } } while (0)
@@ -39,12 +54,12 @@ static int utf8_size(unsigned char c) {
  */
 static int utf8_rsize(const unsigned char *s, size_t len) {
     size_t curr;
-    for (curr = len - 1; curr != -1; curr--) {
+    for (curr = len - 1; curr != (size_t)-1; curr--) {
         if ((s[curr] & 0xc0) != 0x80) // continuation
             break;
     }
 
-    if (curr == -1)
+    if (curr == (size_t)-1)
         return 0;
 
     return len - curr;
@@ -60,7 +75,7 @@ static ssize_t utf8_strnlen(const char *c, size_t n) {
         if (u8sz < 1)
             return -1; // continuation byte or invalid utf8
         
-        if (u8sz > n)
+        if ((size_t)u8sz > n)
             return -1; // out-of-bounds
         
         for (int i = 1; i < u8sz; i++)
@@ -79,6 +94,133 @@ static ssize_t utf8_strlen(const char *c) {
     return utf8_strnlen(c, (size_t)-1);
 }
 
+/**
+ * decodes the character at `s`, reading at most `n` bytes.
+ * returns its size and sets `out_cp`, invalid or truncated characters decode as a single byte of U+FFFD.
+ */
+static int utf8_decode(const char *s, size_t n, uint32_t *out_cp) {
+    const unsigned char *u = (const unsigned char *)s;
+    int sz = utf8_size(u[0]);
+    if (sz == 1) {
+        *out_cp = u[0];
+        return 1;
+    }
+    if (sz < 1 || (size_t)sz > n)
+        goto invalid;
+
+    uint32_t cp = u[0] & (0x7f >> sz);
+    for (int i = 1; i < sz; i++) {
+        if ((u[i] & 0xc0) != 0x80)
+            goto invalid;
+        cp = (cp << 6) | (u[i] & 0x3f);
+    }
+    *out_cp = cp;
+    return sz;
+
+invalid:
+    *out_cp = 0xfffd;
+    return 1;
+}
+
+/**
+ * returns the display width (0, 1 or 2 columns) of code point `cp`.
+ */
+static int utf8_cpwidth(uint32_t cp) {
+    if (cp >= 0x110000)
+        return 1;
+    return (wcwidth_stage2[wcwidth_stage1[cp >> 8]][(cp & 0xff) >> 2] >> ((cp & 3) * 2)) & 3;
+}
+
+/**
+ * returns the display width of the characters starting in the first `n` bytes of `s`,
+ * where the last one may continue up to byte `lim`. it can start in the middle of a character.
+ * if `out_wide` is not NULL, the amount of characters 2 columns wide is added to it.
+ */
+static size_t utf8_nwidth(const char *s, size_t n, size_t lim, size_t *out_wide) {
+    size_t width = 0, wide = 0;
+    uint32_t cp;
+    int w;
+
+    for (size_t i = 0; i < n; ) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c < 0x7f) {
+            width++; // ascii fast path
+            i++;
+            continue;
+        }
+        if ((c & 0xc0) == 0x80) {
+            i++; // tail of a character started before `s`
+            continue;
+        }
+        i += utf8_decode(s + i, lim - i, &cp);
+        w = utf8_cpwidth(cp);
+        width += w;
+        wide += (w == 2);
+    }
+
+    if (out_wide)
+        *out_wide += wide;
+    return width;
+}
+
+static size_t utf8_width(const char *s, size_t n) {
+    return utf8_nwidth(s, n, n, NULL);
+}
+
+/**
+ * returns the display width of the character at `s`, reading at most `n` bytes.
+ */
+static int utf8_chwidth(const char *s, size_t n) {
+    uint32_t cp;
+    utf8_decode(s, n, &cp);
+    return utf8_cpwidth(cp);
+}
+
+/**
+ * returns the size in bytes of the character at `s` together with the zero width characters
+ * (combining marks) following it, reading at most `n` bytes, or -1 on error.
+ * their display width is returned via `out_width`.
+ */
+static ssize_t utf8_next(const char *s, size_t n, size_t *out_width) {
+    size_t i = 0;
+    int cnt;
+
+    *out_width = 0;
+    do {
+        if ((cnt = utf8_size(s[i])) < 1)
+            return -1; // invalid utf8 length
+        if ((size_t)cnt > n - i)
+            cnt = n - i;
+        *out_width += utf8_chwidth(s + i, cnt);
+        i += cnt;
+    } while (i < n && (unsigned char)s[i] >= 0x80 && !utf8_chwidth(s + i, n - i));
+
+    return i;
+}
+
+/**
+ * returns the size in bytes of the character ending at `s + n` together with the zero width
+ * characters (combining marks) following it, or -1 on error.
+ * their display width is returned via `out_width`.
+ */
+static ssize_t utf8_prev(const char *s, size_t n, size_t *out_width) {
+    size_t i = n;
+    int cnt, w;
+
+    *out_width = 0;
+    do {
+        if (!(cnt = utf8_rsize((const unsigned char *)s, i)))
+            return -1; // invalid utf8 length
+        if ((size_t)cnt > i)
+            cnt = i;
+        i -= cnt;
+        w = utf8_chwidth(s + i, cnt);
+        *out_width += w;
+    } while (i && !w && (unsigned char)s[i] >= 0x80);
+
+    return n - i;
+}
+
 /////////////
 // Helper functions
 /////////////
@@ -137,6 +279,387 @@ static char *resolve_command_path(const char *command) {
     return NULL;
 }
 
+/////////////
+// Virtual terminal
+/////////////
+
+/**
+ * model of the part of a vt100 (as xterm does it) that the prompt writes to, so replays and
+ * benchmarks can check what frames leave on screen without a terminal.
+ * output is taken as rmsh writes it, before the tty turns "\n" into "\r\n".
+ * writing the last column leaves the cursor there until the next character, which goes to the
+ * next row, and so does a wide character that doesn't fit in the row.
+ */
+#define VT_PARAMS 4
+
+struct vt_cell {
+    char    ch[14]; // utf8 of the character with its combining marks (the ones that fit), blank if empty
+    uint8_t len;
+    uint8_t wide;   // 1 on the first cell of a wide character, 2 on the second
+};
+
+enum {
+    VT_GROUND = 0,
+    VT_ESC,
+    VT_CSI,
+};
+
+struct vt {
+    size_t rows;
+    size_t cols;
+    struct vt_cell *cells;
+    size_t x;
+    size_t y;
+    int    wrap; // the last column was written
+    size_t saved_x;
+    size_t saved_y;
+    int    saved_wrap;
+    size_t scrolled; // rows scrolled off the top
+    int    paste;    // bracketed paste mode is set
+    int    sync;     // synchronized output mode is set
+    size_t unknown;  // sequences that aren't modelled
+
+    int  state;
+    int  priv;  // the sequence has a private marker ('?')
+    int  inter; // intermediate byte, 0 if none
+    int  param[VT_PARAMS];
+    int  nparam;
+    char u[4];  // character being decoded
+    int  ulen;
+};
+
+/**
+ * returns 0 on success and -1 on error.
+ */
+static int vt_open(struct vt *vt, size_t rows, size_t cols)
+{
+    memset(vt, 0, sizeof(*vt));
+    if (!rows || !cols || !(vt->cells = calloc(rows * cols, sizeof(*vt->cells))))
+        return -1;
+    vt->rows = rows;
+    vt->cols = cols;
+    return 0;
+}
+
+static void vt_close(struct vt *vt)
+{
+    free(vt->cells);
+    vt->cells = NULL;
+}
+
+static struct vt_cell *vt_cell(const struct vt *vt, size_t y, size_t x)
+{
+    return &vt->cells[y * vt->cols + x];
+}
+
+static int vt_blank(const struct vt_cell *c)
+{
+    return (!c->len || (c->len == 1 && c->ch[0] == ' ')) && !c->wide;
+}
+
+/**
+ * blanks the halves of wide characters left without the other one on row `y`.
+ */
+static void vt_fix(struct vt *vt, size_t y)
+{
+    for (size_t x = 0; x < vt->cols; x++) {
+        struct vt_cell *c = vt_cell(vt, y, x);
+        if ((c->wide == 1 && (x + 1 == vt->cols || c[1].wide != 2)) || (c->wide == 2 && (!x || c[-1].wide != 1)))
+            memset(c, 0, sizeof(*c));
+    }
+}
+
+/**
+ * blanks columns [from, to) of row `y`, and the halves of wide characters they cut.
+ */
+static void vt_erase(struct vt *vt, size_t y, size_t from, size_t to)
+{
+    if (to > vt->cols)
+        to = vt->cols;
+    if (from >= to)
+        return;
+    if (from && vt_cell(vt, y, from)->wide == 2)
+        from--;
+    if (to < vt->cols && vt_cell(vt, y, to)->wide == 2)
+        to++;
+    memset(vt_cell(vt, y, from), 0, (to - from) * sizeof(struct vt_cell));
+}
+
+static void vt_linefeed(struct vt *vt)
+{
+    if (vt->y + 1 < vt->rows) {
+        vt->y++;
+        return;
+    }
+    memmove(vt->cells, vt->cells + vt->cols, (vt->rows - 1) * vt->cols * sizeof(struct vt_cell));
+    memset(vt_cell(vt, vt->rows - 1, 0), 0, vt->cols * sizeof(struct vt_cell));
+    vt->scrolled++;
+}
+
+/**
+ * writes the character `s` of `n` bytes and `w` columns at the cursor.
+ */
+static void vt_print(struct vt *vt, const char *s, int n, int w)
+{
+    struct vt_cell *c;
+
+    // combining marks go to the character before the cursor
+    if (!w) {
+        size_t x = (vt->wrap ? vt->x : vt->x - !!vt->x);
+        c = vt_cell(vt, vt->y, x);
+        if (c->wide == 2)
+            c--;
+        if (c->len && c->len + n <= (int)sizeof(c->ch)) {
+            memcpy(c->ch + c->len, s, n);
+            c->len += n;
+        }
+        return;
+    }
+    if (w > (int)vt->cols)
+        return;
+
+    if (vt->wrap || (w == 2 && vt->x + 1 == vt->cols)) {
+        if (!vt->wrap)
+            vt_erase(vt, vt->y, vt->x, vt->cols);
+        vt->x = 0;
+        vt->wrap = 0;
+        vt_linefeed(vt);
+    }
+
+    vt_erase(vt, vt->y, vt->x, vt->x + w);
+    c = vt_cell(vt, vt->y, vt->x);
+    memcpy(c->ch, s, n);
+    c->len = n;
+    c->wide = (w == 2);
+    if (w == 2)
+        c[1].wide = 2;
+
+    if (vt->x + w >= vt->cols) {
+        vt->x = vt->cols - 1;
+        vt->wrap = 1;
+    } else {
+        vt->x += w;
+    }
+}
+
+static void vt_csi(struct vt *vt, int final)
+{
+    int n = (vt->param[0] > 0 ? vt->param[0] : 1);
+    size_t y, x;
+
+    if (vt->priv == '?' && !vt->inter && (final == 'h' || final == 'l')) {
+        for (int i = 0; i < vt->nparam; i++) {
+            if (vt->param[i] == 2004)
+                vt->paste = (final == 'h');
+            else if (vt->param[i] == 2026)
+                vt->sync = (final == 'h');
+            else
+                vt->unknown++;
+        }
+        return;
+    }
+    if (vt->priv || vt->inter) {
+        vt->unknown++;
+        return;
+    }
+    if (final == 'm')
+        return; // colors aren't modelled
+
+    vt->wrap = 0;
+    if (final == 'A')
+        vt->y = (vt->y > (size_t)n ? vt->y - n : 0);
+    else if (final == 'B')
+        vt->y = (vt->y + n < vt->rows ? vt->y + n : vt->rows - 1);
+    else if (final == 'C')
+        vt->x = (vt->x + n < vt->cols ? vt->x + n : vt->cols - 1);
+    else if (final == 'D')
+        vt->x = (vt->x > (size_t)n ? vt->x - n : 0);
+    else if (final == 'G')
+        vt->x = ((size_t)n < vt->cols ? (size_t)n : vt->cols) - 1;
+    else if (final == 'd')
+        vt->y = ((size_t)n < vt->rows ? (size_t)n : vt->rows) - 1;
+    else if (final == 'H' || final == 'f') {
+        y = (size_t)n;
+        x = (vt->nparam > 1 && vt->param[1] > 0 ? (size_t)vt->param[1] : 1);
+        vt->y = (y < vt->rows ? y : vt->rows) - 1;
+        vt->x = (x < vt->cols ? x : vt->cols) - 1;
+    }
+    else if (final == 'K') {
+        if (vt->param[0] == 0)
+            vt_erase(vt, vt->y, vt->x, vt->cols);
+        else if (vt->param[0] == 1)
+            vt_erase(vt, vt->y, 0, vt->x + 1);
+        else
+            vt_erase(vt, vt->y, 0, vt->cols);
+    }
+    else if (final == 'J') {
+        if (vt->param[0] == 0) {
+            vt_erase(vt, vt->y, vt->x, vt->cols);
+            for (y = vt->y + 1; y < vt->rows; y++)
+                vt_erase(vt, y, 0, vt->cols);
+        } else {
+            for (y = 0; y < vt->rows; y++)
+                if (vt->param[0] != 1 || y < vt->y)
+                    vt_erase(vt, y, 0, vt->cols);
+            if (vt->param[0] == 1)
+                vt_erase(vt, vt->y, 0, vt->x + 1);
+        }
+    }
+    else if (final == '@' || final == 'P') {
+        struct vt_cell *c = vt_cell(vt, vt->y, vt->x);
+        size_t left = vt->cols - vt->x, k = ((size_t)n < left ? (size_t)n : left);
+        if (final == '@') {
+            memmove(c + k, c, (left - k) * sizeof(*c));
+            memset(c, 0, k * sizeof(*c));
+        } else {
+            memmove(c, c + k, (left - k) * sizeof(*c));
+            memset(c + left - k, 0, k * sizeof(*c));
+        }
+        vt_fix(vt, vt->y);
+    }
+    else
+        vt->unknown++;
+}
+
+/**
+ * takes `n` bytes of output.
+ */
+static void vt_feed(struct vt *vt, const char *s, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = s[i];
+
+        if (c == '\e') {
+            vt->state = VT_ESC;
+            vt->ulen = 0;
+            continue;
+        }
+
+        if (vt->state == VT_ESC) {
+            vt->state = VT_GROUND;
+            if (c == '[') {
+                vt->state = VT_CSI;
+                vt->priv = vt->inter = vt->nparam = 0;
+                memset(vt->param, 0, sizeof(vt->param));
+            } else if (c == '7') {
+                vt->saved_x = vt->x;
+                vt->saved_y = vt->y;
+                vt->saved_wrap = vt->wrap;
+            } else if (c == '8') {
+                vt->x = vt->saved_x;
+                vt->y = vt->saved_y;
+                vt->wrap = vt->saved_wrap;
+            } else {
+                vt->unknown++;
+            }
+            continue;
+        }
+
+        if (vt->state == VT_CSI) {
+            if (c >= '0' && c <= '9') {
+                if (!vt->nparam)
+                    vt->nparam = 1;
+                if (vt->nparam <= VT_PARAMS && vt->param[vt->nparam - 1] < 100000)
+                    vt->param[vt->nparam - 1] = vt->param[vt->nparam - 1] * 10 + (c - '0');
+            } else if (c == ';') {
+                vt->nparam += (vt->nparam ? 1 : 2);
+            } else if (c >= '<' && c <= '?') {
+                vt->priv = c;
+            } else if (c >= 0x20 && c <= 0x2f) {
+                vt->inter = c;
+            } else if (c >= 0x40 && c <= 0x7e) {
+                if (vt->nparam > VT_PARAMS)
+                    vt->nparam = VT_PARAMS;
+                vt->state = VT_GROUND;
+                vt_csi(vt, c);
+            }
+            continue;
+        }
+
+        if (c < 0x20 || c == 0x7f) {
+            vt->ulen = 0;
+            if (c == '\r' || c == '\n') {
+                vt->x = 0;
+                vt->wrap = 0;
+                if (c == '\n')
+                    vt_linefeed(vt);
+            } else if (c == '\b') {
+                vt->x -= !!vt->x;
+                vt->wrap = 0;
+            } else if (c == '\t') {
+                vt->x = ((vt->x / 8 + 1) * 8 < vt->cols ? (vt->x / 8 + 1) * 8 : vt->cols - 1);
+                vt->wrap = 0;
+            }
+            continue;
+        }
+
+        // characters are decoded whole, a broken one is printed as U+FFFD
+        uint32_t cp;
+        if (vt->ulen && (c & 0xc0) != 0x80) {
+            vt_print(vt, "\xef\xbf\xbd", 3, 1);
+            vt->ulen = 0;
+        }
+        vt->u[vt->ulen++] = c;
+        if (vt->ulen < utf8_size(vt->u[0]) && vt->ulen < (int)sizeof(vt->u))
+            continue;
+        int sz = utf8_decode(vt->u, vt->ulen, &cp);
+        if (sz != vt->ulen)
+            vt_print(vt, "\xef\xbf\xbd", 3, 1);
+        else
+            vt_print(vt, vt->u, sz, utf8_cpwidth(cp));
+        vt->ulen = 0;
+    }
+}
+
+/**
+ * returns 0 if `vt` shows `text` (`len` bytes) laid out from the first column of row `top`
+ * (negative if it scrolled off), with nothing after it and the cursor on cell `cur`, and -1 otherwise.
+ * cells are counted row after row, the way the prompt counts them.
+ */
+static int vt_check(const struct vt *vt, ssize_t top, const char *text, size_t len, size_t cur)
+{
+    size_t cell = 0, cols = vt->cols, w;
+    ssize_t n, y;
+
+    for (size_t i = 0; i < len; i += n) {
+        n = 1;
+        if (text[i] == '\n') {
+            if (!(cell % cols == 0 && i && text[i - 1] != '\n'))
+                cell = (cell / cols + 1) * cols;
+            continue;
+        }
+        if (-1 == (n = utf8_next(text + i, len - i, &w)))
+            return -1;
+        if (!w || w > cols)
+            continue; // nothing a terminal would put in a cell
+
+        if (w == 2 && cell % cols == cols - 1) {
+            y = top + cell / cols;
+            if (y >= (ssize_t)vt->rows || (y >= 0 && !vt_blank(vt_cell(vt, y, cols - 1))))
+                return -1;
+            cell++;
+        }
+
+        y = top + cell / cols;
+        if (y >= (ssize_t)vt->rows)
+            return -1;
+        if (y >= 0) {
+            const struct vt_cell *c = vt_cell(vt, y, cell % cols);
+            size_t cmp = ((size_t)n < sizeof(c->ch) ? (size_t)n : c->len);
+            if (c->len != cmp || memcmp(c->ch, text + i, cmp) || c->wide != (w == 2))
+                return -1;
+        }
+        cell += w;
+    }
+
+    // nothing after the text, down to the bottom
+    for (; (y = top + cell / cols) < (ssize_t)vt->rows; cell++)
+        if (y >= 0 && !vt_blank(vt_cell(vt, y, cell % cols)))
+            return -1;
+
+    return (top + (ssize_t)(cur / cols) == (ssize_t)vt->y && cur % cols == vt->x) ? 0 : -1;
+}
+
 /////////////
 // History
 /////////////
@@ -190,9 +713,22 @@ static const char *history_get(size_t idx) {
 #define VT_CURBCK "\e[D"  // move cursor backward
 #define VT_CURFWD_N "\e[%dC" // move cursor N times forward
 #define VT_CURBCK_N "\e[%dD" // move cursor N times backward
+#define VT_CHRINS_N "\e[%d@" // insert N blank characters at cursor
+#define VT_CHRDEL_N "\e[%dP" // delete N characters at cursor
+#define VT_CURUP_N  "\e[%dA" // move cursor N rows up
+#define VT_CURDN_N  "\e[%dB" // move cursor N rows down
+#define VT_SCREOS   "\e[J"   // clear from cursor to end of screen
 #define VT_CURSET_R "\e[%dd" // move cursor to row R
 #define VT_CURSET_C "\e[%dG" // move cursor to column C
 #define VT_CURSET_R_C "\e[%d;%dH"  // move cursor to row R column C
+#define VT_PASTE_ON  "\e[?2004h" // enable bracketed paste
+#define VT_PASTE_OFF "\e[?2004l" // disable bracketed paste
+#define VT_SYNC_ON   "\e[?2026h" // begin synchronized update, the terminal shows nothing until it ends
+#define VT_SYNC_OFF  "\e[?2026l" // end synchronized update
+#define VT_PASTE_QUERY "\e[?2004$p" // request the state of bracketed paste (DECRQM), answered with "\e[?2004;Ps$y"
+#define VT_SYNC_QUERY  "\e[?2026$p" // request the state of synchronized output (DECRQM), answered with "\e[?2026;Ps$y"
+#define VT_DA2_QUERY   "\e[>c" // secondary device attributes, answered with "\e[>Pp;Pv;Pcc", the terminal type and version
+#define VT_DA_QUERY    "\e[c" // primary device attributes, every terminal answers, and after the queries before it
 
 #define PRMT_EXIT ((void *)-1)
 #define PRMT_ABRT ((void *)-2)
@@ -201,1324 +737,5701 @@ static const char *history_get(size_t idx) {
 #define PRMT_SRCH_TLEN   (sizeof(PRMT_SRCH_TEXT)-1)
 #define PRMT_SRCH_QSTART (PRMT_SRCH_TLEN-3)
 
-struct prompt {
-    const char *prmt_ps1;
-
-    char  *prmt_line[HIST_MAX+1];
-    size_t prmt_cur_row; // 0 is current line
-    size_t prmt_cur_col;
+#define PRMT_INPUT_SZ 4096
 
-    char   *prmt_srch_line;
-    size_t  prmt_srch_line_sz;
-    size_t  prmt_srch_query_sz;
+/**
+ * ring buffer of raw terminal input.
+ * every wakeup reads everything available with a single read, and the editor decodes
+ * all complete sequences before reading again.
+ * `head` and `tail` only grow, their difference is the amount of pending bytes.
+ */
+struct prompt_input {
+    unsigned char buf[PRMT_INPUT_SZ];
+    size_t head; // next byte to decode
+    size_t tail; // next byte to fill
 };
 
-static void __prompt_reset(struct prompt *p, const char *ps1) {
-    for (int i = 0; i < (HIST_MAX+1); i++)
-        if (p->prmt_line[i])
-            free(p->prmt_line[i]);
-    if (p->prmt_srch_line)
-        free(p->prmt_srch_line);
-    memset(p, 0, sizeof(*p));
-    p->prmt_ps1 = ps1;
+static size_t prompt_input_pending(const struct prompt_input *in)
+{
+    return in->tail - in->head;
 }
 
-static const char *__prompt_get(struct prompt *p, size_t idx) {
-    if (idx >= (1+HIST_MAX))
-        return NULL;
-    return p->prmt_line[idx] ?: (idx ? history_get(idx - 1) : NULL);
+static int prompt_input_getc(struct prompt_input *in)
+{
+    return in->buf[in->head++ % PRMT_INPUT_SZ];
 }
 
-static const char *prompt_get(struct prompt *p) {
-    return __prompt_get(p, p->prmt_cur_row);
+/**
+ * reads all the input available into the free space of the ring, blocking until there's some.
+ * returns the amount of bytes read, 0 on EOF or -1 on error.
+ */
+static ssize_t prompt_input_fill(struct prompt_input *in, int fd)
+{
+    struct iovec iov[2];
+    size_t tail = in->tail % PRMT_INPUT_SZ;
+    size_t space = PRMT_INPUT_SZ - prompt_input_pending(in);
+    int iovcnt = 1;
+    ssize_t n;
+
+    if (!space)
+        return -1; // full, caller must decode first
+
+    // free space may wrap around the end of the buffer
+    iov[0].iov_base = in->buf + tail;
+    iov[0].iov_len = PRMT_INPUT_SZ - tail;
+    if (iov[0].iov_len > space)
+        iov[0].iov_len = space;
+    if (iov[0].iov_len < space) {
+        iov[1].iov_base = in->buf;
+        iov[1].iov_len = space - iov[0].iov_len;
+        iovcnt = 2;
+    }
+
+    while (-1 == (n = readv(fd, iov, iovcnt)) && errno == EINTR);
+    if (n > 0)
+        in->tail += n;
+    return n;
 }
 
 /**
- * returns 0 on succes and adjusts `out_moves` by the amount of moves required
- * returns -1 on error
- * NOTE: this modifies the internal state of `p`, including cursor position
+ * events the prompt waits for: terminal input, the signals it handles and a timer.
+ * it's an epoll set over stdin, a signalfd and a timerfd.
+ * the signals are only taken while the loop is open.
  */
-static int __prompt_search(struct prompt *p, size_t start_idx, const void *needle, size_t needle_len, int *out_moves) {
-    const char *s, *f;
-    size_t n;
+enum {
+    PRMT_EV_INPUT = 0x01, // stdin is readable
+    PRMT_EV_WINCH = 0x02, // the terminal was resized
+    PRMT_EV_CHLD  = 0x04, // a child changed state
+    PRMT_EV_INT   = 0x08, // SIGINT
+    PRMT_EV_TIMER = 0x10, // the timer expired
+};
 
-    size_t idx;
-    size_t pos;
-    int found = 0;
+struct prompt_loop {
+    int input; // stdin is watched
+    int fd;      // epoll
+    int sigfd;   // signalfd
+    int timerfd;
+    sigset_t oldmask;
+};
 
-    for (size_t i = start_idx; i < (1+HIST_MAX); i++) {
-        s = __prompt_get(p, i);
-        n = (s ? strlen(s) : 0);
+static const int prompt_loop_signals[] = {SIGWINCH, SIGCHLD, SIGINT};
 
-        if (n < needle_len)
-            continue;
-        
-        f = (const char *)memmem(s, n, needle, needle_len);
-        if (!f)
-            continue;
-        
-        idx = i;
-        pos = ((size_t)f) - (size_t)s;
-        found = 1;
-        break;
-    }
+static int prompt_loop_event(int sig)
+{
+    return (sig == SIGWINCH ? PRMT_EV_WINCH : sig == SIGCHLD ? PRMT_EV_CHLD : PRMT_EV_INT);
+}
 
-    // not found, just return success without doing anything
-    if (!found)
-        return 0;
+static void prompt_loop_close(struct prompt_loop *l);
+
+/**
+ * returns 0 on success and -1 on error, with nothing left open.
+ */
+static int prompt_loop_open(struct prompt_loop *l)
+{
+    struct epoll_event ev[3] = {{.events = EPOLLIN}, {.events = EPOLLIN}, {.events = EPOLLIN}};
+    sigset_t mask;
 
-    // find utf8-aware cursor position for the previous result and next result (so we know how to move it)
-    ssize_t nextlen = utf8_strnlen(s, pos);
-    ssize_t prevlen = utf8_strnlen(__prompt_get(p, p->prmt_cur_row), p->prmt_cur_col);
-    if (prevlen == -1 || nextlen == -1)
-        return -1; // invalid cursor position
+    l->fd = l->sigfd = l->timerfd = -1;
+    l->input = 1;
 
-    // replace old result with new result in search line, and make sure is null terminated
-    if (!(p->prmt_srch_line = realloc(p->prmt_srch_line, PRMT_SRCH_TLEN + p->prmt_srch_query_sz + n + 1))) // +1 for \0
+    sigemptyset(&mask);
+    for (size_t i = 0; i < sizeof(prompt_loop_signals) / sizeof(*prompt_loop_signals); i++)
+        sigaddset(&mask, prompt_loop_signals[i]);
+    if (sigprocmask(SIG_BLOCK, &mask, &l->oldmask))
         return -1;
-    memcpy(p->prmt_srch_line + PRMT_SRCH_TLEN + p->prmt_srch_query_sz, s, n);
-    p->prmt_srch_line[PRMT_SRCH_TLEN + p->prmt_srch_query_sz + n] = 0;
-    
-    p->prmt_cur_row = idx;
-    p->prmt_cur_col = pos;
-    *out_moves += nextlen - prevlen;
-    return 0;
-}
 
-static int prompt_is_search(struct prompt *p) {
-    return !!(p->prmt_srch_line);
+    if (-1 == (l->fd = epoll_create1(EPOLL_CLOEXEC)) ||
+        -1 == (l->sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) ||
+        -1 == (l->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)))
+        goto err;
+
+    ev[0].data.fd = STDIN_FILENO;
+    ev[1].data.fd = l->sigfd;
+    ev[2].data.fd = l->timerfd;
+    for (int i = 0; i < 3; i++)
+        if (epoll_ctl(l->fd, EPOLL_CTL_ADD, ev[i].data.fd, &ev[i]))
+            goto err;
+    return 0;
+err:
+    prompt_loop_close(l);
+    return -1;
 }
 
-#define GETCHAR(C) do { C = getchar(); ASSERT_PERROR(EOF != C || errno == EINTR, "getchar"); } while (C == EOF)
-#define ECHO_CNTRL(C) printf("^%c", 'A'+C-1)
-
-static int debug_prompt(struct termios *termios_p)
+/**
+ * takes the signals that came but weren't waited for, so none is delivered once they're unblocked.
+ */
+static void prompt_loop_close(struct prompt_loop *l)
 {
-    int ret = 1;
-    struct termios raw_termios;
-    memcpy(&raw_termios, termios_p, sizeof(raw_termios));
-    raw_termios.c_iflag &= ~(IXON);
-    raw_termios.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
-    ASSERT_PERROR(tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_termios) == 0, "tcsetattr");
+    struct signalfd_siginfo si;
 
-    while (1) {
-        int c;
-        GETCHAR(c);
-        if (iscntrl(c))
-            printf("\\0%x %d\n", c, c);
-        else
-            printf("\\0%x %d '%c'\n", c, c, c);
-        if (c == CTRL_D) {
-            ret = 0;
-            goto out;
-        }
+    if (l->sigfd != -1) {
+        while (sizeof(si) == read(l->sigfd, &si, sizeof(si)));
+        close(l->sigfd);
     }
+    if (l->timerfd != -1)
+        close(l->timerfd);
+    if (l->fd != -1)
+        close(l->fd);
+    sigprocmask(SIG_SETMASK, &l->oldmask, NULL);
+}
 
-out:
-    tcsetattr(STDIN_FILENO, TCSADRAIN, termios_p);
-    return ret;
+/**
+ * starts or stops watching stdin, it's left alone while there's no room for what it has.
+ * returns 0 on success and -1 on error.
+ */
+static int prompt_loop_input(struct prompt_loop *l, int on)
+{
+    struct epoll_event ev = {.events = (on ? EPOLLIN : 0), .data.fd = STDIN_FILENO};
+    if (l->input == on)
+        return 0;
+    l->input = on;
+    return epoll_ctl(l->fd, EPOLL_CTL_MOD, STDIN_FILENO, &ev);
 }
 
-static int prompt_winch = 0;
+/**
+ * arms the timer to expire in `ms` milliseconds, or disarms it if negative.
+ * returns 0 on success and -1 on error.
+ */
+static int prompt_loop_timer(struct prompt_loop *l, int ms)
+{
+    struct itimerspec its = {0};
+    uint64_t expired;
 
-static void prompt_winch_sighandler(int signum, siginfo_t * siginfo, void * ucontext) {
-    prompt_winch = 1;
+    if (ms >= 0) {
+        its.it_value.tv_sec = ms / 1000;
+        its.it_value.tv_nsec = (ms % 1000) * 1000000 ?: 1; // zero would disarm it
+    }
+    while (sizeof(expired) == read(l->timerfd, &expired, sizeof(expired))); // an old expiry must not count
+    return timerfd_settime(l->timerfd, 0, &its, NULL);
 }
 
-enum {
-    TCHTYPE_UNK = 0,
-    TCHTYPE_TEXT,
-    TCHTYPE_CTRL,
-};
-
-enum {
-    TCHCTRL_UNK = 0,
+/**
+ * blocks until something happens.
+ * returns the PRMT_EV_* that happened, or -1 on error.
+ */
+static int prompt_loop_wait(struct prompt_loop *l)
+{
+    struct epoll_event evs[3];
+    struct signalfd_siginfo si;
+    uint64_t expired;
+    int n, ret = 0;
 
-    TCHCTRL_LINEKILL,
-    TCHCTRL_EXIT,
-    TCHCTRL_CLEAR,
-    TCHCTRL_ENTER,
-    TCHCTRL_TAB,
-    TCHCTRL_SEARCH,
+    while (-1 == (n = epoll_wait(l->fd, evs, 3, -1)) && errno == EINTR);
+    if (n == -1)
+        return -1;
 
-    TCHCTRL_DEL,
-    TCHCTRL_BACKSPACE,
+    for (int i = 0; i < n; i++) {
+        if (evs[i].data.fd == STDIN_FILENO)
+            ret |= PRMT_EV_INPUT;
+        else if (evs[i].data.fd == l->sigfd)
+            while (sizeof(si) == read(l->sigfd, &si, sizeof(si)))
+                ret |= prompt_loop_event(si.ssi_signo);
+        else if (sizeof(expired) == read(l->timerfd, &expired, sizeof(expired)))
+            ret |= PRMT_EV_TIMER;
+    }
+    return ret;
+}
 
-    TCHCTRL_HOME,
-    TCHCTRL_END,
-    TCHCTRL_BCKWARD,
-    TCHCTRL_FORWARD,
+#define PRMT_LINE_GAP 64
 
-    TCHCTRL_UP,
-    TCHCTRL_DN,
-    TCHCTRL_PGUP,
-    TCHCTRL_PGDN,
+/**
+ * gap buffer of a line being edited.
+ * the gap follows the cursor, so typing and deleting next to it never moves the rest of the line.
+ * text is `buf[0, gap)` followed by `buf[gap_end, cap)`, and `buf[cap]` is always \0.
+ */
+struct prompt_line {
+    char  *buf;
+    size_t cap;
+    size_t gap;
+    size_t gap_end;
+    size_t cols; // display columns of the line
+    size_t wide; // characters 2 columns wide, they leave gaps when wrapped
 };
 
-#define TCHSET_CTRL(TermCharPtr, Value) do { (TermCharPtr)->tch_type = TCHTYPE_CTRL; (TermCharPtr)->tch_ctrl.value = (Value); } while (0)
+static size_t prompt_line_len(const struct prompt_line *l)
+{
+    return l->cap - (l->gap_end - l->gap);
+}
 
-struct __termchar {
-    uint8_t       tch_type; // TCHT_*
-    union {
-        struct {
-            char data[5];
-            uint8_t in;
-            uint8_t sz;
-        } tch_text;
-        struct {
-            struct {
-                char data[4];
-                uint8_t count;
-            } private;
-            uint8_t value;
-        } tch_ctrl;
-    };
-};
+/**
+ * moves the gap to byte `pos` of the line, so text before `pos` is contiguous at `buf`
+ * and text after it is contiguous (and null terminated) at `buf + gap_end`.
+ */
+static void prompt_line_seek(struct prompt_line *l, size_t pos)
+{
+    if (pos < l->gap)
+        memmove(l->buf + l->gap_end - (l->gap - pos), l->buf + pos, l->gap - pos);
+    else if (pos > l->gap)
+        memmove(l->buf + l->gap, l->buf + l->gap_end, pos - l->gap);
+    l->gap_end += pos - l->gap;
+    l->gap = pos;
+}
 
 /**
- * returns: 1 on success, 0 if needs to read more or -1 on failure
+ * makes the gap at least `n` bytes long.
+ * returns 0 on success and -1 on error.
  */
-static int __termchar_input(struct __termchar *termchar, int c)
+static int prompt_line_reserve(struct prompt_line *l, size_t n)
 {
-    if (termchar->tch_type == TCHTYPE_UNK) {
-        if (c == '\e') {
-            termchar->tch_type = TCHTYPE_CTRL;
-            termchar->tch_ctrl.private.count = 0;
-            return 0; // read more data
-        }
-        if (c == CTRL_A) {
-            TCHSET_CTRL(termchar, TCHCTRL_HOME);
-            return 1;
-        }
-        if (c == CTRL_B) {
-            TCHSET_CTRL(termchar, TCHCTRL_BCKWARD);
-            return 1;
-        }
-        if (c == CTRL_C) {
-            TCHSET_CTRL(termchar, TCHCTRL_LINEKILL);
-            return 1;
-        }
-        if (c == CTRL_D) {
-            TCHSET_CTRL(termchar, TCHCTRL_EXIT);
-            return 1;
-        }
-        if (c == CTRL_E) {
-            TCHSET_CTRL(termchar, TCHCTRL_END);
-            return 1;
-        }
-        if (c == CTRL_F) {
-            TCHSET_CTRL(termchar, TCHCTRL_FORWARD);
-            return 1;
-        }
-        if (c == CTRL_R) {
-            TCHSET_CTRL(termchar, TCHCTRL_SEARCH);
-            return 1;
-        }
-        if (c == CTRL_L) {
-            TCHSET_CTRL(termchar, TCHCTRL_CLEAR);
-            return 1;
-        }
-        if (c == '\n') {
-            TCHSET_CTRL(termchar, TCHCTRL_ENTER);
-            return 1;
-        }
-        if (c == '\t') {
-            TCHSET_CTRL(termchar, TCHCTRL_TAB);
-            return 1;
-        }
-        if (c == BACKSPACE) {
-            TCHSET_CTRL(termchar, TCHCTRL_BACKSPACE);
-            return 1;
-        }
-        
-        if (iscntrl(c))
-            return -1; // unknown control character
-        
-        termchar->tch_type = TCHTYPE_TEXT;
-        termchar->tch_text.data[0] = c;
-        termchar->tch_text.in = 1;
+    if (l->gap_end - l->gap >= n)
+        return 0;
 
-        if ((termchar->tch_text.sz = utf8_size(c)) < 1)
-            return -1; // invalid utf8 starting char (either invalid or continuation
-        
-        if (termchar->tch_text.sz == 1)
-            return 1; // got a single-sized character, can exit
-        
-        return 0; // need more chars
-    }
+    size_t tail = l->cap - l->gap_end;
+    size_t cap = l->cap * 2;
+    if (cap < prompt_line_len(l) + n + PRMT_LINE_GAP)
+        cap = prompt_line_len(l) + n + PRMT_LINE_GAP;
 
-    if (termchar->tch_type == TCHTYPE_TEXT) {
-        if (termchar->tch_text.in >= termchar->tch_text.sz)
-            return -1; // cannot read anymore characters
-        
-        termchar->tch_text.data[termchar->tch_text.in++] = c;
+    char *buf = realloc(l->buf, cap + 1); // +1 for \0
+    if (!buf)
+        return -1;
+    memmove(buf + cap - tail, buf + l->gap_end, tail);
+    buf[cap] = 0;
 
-        if (termchar->tch_text.in == termchar->tch_text.sz) {
-            termchar->tch_text.data[termchar->tch_text.sz] = 0;
-            return 1; // finished reading
-        }
+    l->buf = buf;
+    l->gap_end = cap - tail;
+    l->cap = cap;
+    return 0;
+}
 
-        return 0; // `in < sz`, need more data
-    }
+/**
+ * inserts `n` bytes (whole characters) at byte `pos`.
+ * returns 0 on success and -1 on error.
+ */
+static int prompt_line_insert(struct prompt_line *l, size_t pos, const char *s, size_t n)
+{
+    if (prompt_line_reserve(l, n))
+        return -1;
+    prompt_line_seek(l, pos);
+    memcpy(l->buf + l->gap, s, n);
+    l->gap += n;
+    l->cols += utf8_nwidth(s, n, n, &l->wide);
+    return 0;
+}
 
-    if (termchar->tch_type != TCHTYPE_CTRL)
-        return -1; // unknown tch_type
-    
-    // tch_type == TCHTYPE_CTRL
+/**
+ * deletes `n` bytes (whole characters) at byte `pos`.
+ */
+static void prompt_line_delete(struct prompt_line *l, size_t pos, size_t n)
+{
+    size_t wide = 0;
+    prompt_line_seek(l, pos);
+    l->cols -= utf8_nwidth(l->buf + l->gap_end, n, n, &wide);
+    l->wide -= wide;
+    l->gap_end += n;
+}
 
-    if (termchar->tch_ctrl.private.count == 0) {
-        if (c != '[' && c != 'O')
-            return -1; // invalid leading escape character
-        termchar->tch_ctrl.private.data[termchar->tch_ctrl.private.count++] = c;
-        return 0; // need more chars
-    }
+/**
+ * returns the whole line as a null terminated string (closing the gap at its end), or NULL if empty.
+ */
+static const char *prompt_line_str(struct prompt_line *l)
+{
+    if (!l->buf)
+        return NULL;
+    prompt_line_seek(l, prompt_line_len(l));
+    l->buf[l->gap] = 0; // either inside the gap or buf[cap]
+    return l->buf;
+}
 
-    if (termchar->tch_ctrl.private.data[0] == 'O') {
-        if (termchar->tch_ctrl.private.count != 1)
-            return -1; // may only have one more char after '\e0'
-        
-        if (c == 'H') {
-            termchar->tch_ctrl.value = TCHCTRL_HOME;
-            return 1;
-        }
+#define PRMT_COLIDX_STEP 4096
 
-        if (c == 'F') {
-            termchar->tch_ctrl.value = TCHCTRL_END;
-            return 1;
-        }
+/**
+ * column index of the current line, built lazily when a byte offset has to be turned into a column.
+ * `cols[i]` is the display width of the characters starting before byte `i * PRMT_COLIDX_STEP`, only the first `n` are valid.
+ */
+struct prompt_colidx {
+    size_t *cols;
+    size_t  n;
+    size_t  cap;
+};
 
-        return -1; // invalid control char after '\eO'
-    }
+/**
+ * model of the prompt on screen, so rendering only emits what changed.
+ * the prompt is assumed to start at the first column, with nothing after `text`.
+ * positions are cells counted row after row (see __render_layout).
+ */
+struct prompt_screen {
+    char  *text; // drawn text, ps1 included
+    size_t len;
+    size_t cap;
+    size_t cur;  // cursor cell
+    size_t end;  // cell after the text
+    size_t width; // terminal columns, 0 if unknown
+    size_t height; // terminal rows, 0 if unknown
+    int    hscroll; // long lines scroll horizontally instead of wrapping
+    size_t hscroll_off; // first line character in the window
+    int    dirty; // text may have changed, otherwise only the cursor moves
+    int    home;  // the screen was cleared, the prompt now starts on its first row
+
+    char  *next; // text of the frame being rendered
+    size_t next_len;
+    size_t next_cap;
+};
 
-    if (termchar->tch_ctrl.private.data[0] != '[')
-        return -1; // invalid control char '\e'
-    
-    // termchar->tch_ctrl.private.data[0] == '['
+#define PRMT_PASTE_END "\e[201~"
 
+/**
+ * text of a bracketed paste, collected until the end marker and inserted all at once.
+ */
+struct prompt_paste {
+    int    active;
+    size_t match; // bytes of PRMT_PASTE_END matched so far
+    char  *buf;
+    size_t len;
+    size_t cap;
+};
 
-    if (termchar->tch_ctrl.private.count == 1) {
-        if (c >= '0' && c <= '9') {
-            termchar->tch_ctrl.private.data[termchar->tch_ctrl.private.count++] = c;
-            return 0; // numeric requires ending ~
-        }
+struct prompt {
+    const char *prmt_ps1;
 
-        if (c == 'A') {
-            termchar->tch_ctrl.value = TCHCTRL_UP;
-            return 1;
-        }
-        if (c == 'B') {
-            termchar->tch_ctrl.value = TCHCTRL_DN;
-            return 1;
-        }
-        if (c == 'C') {
-            termchar->tch_ctrl.value = TCHCTRL_FORWARD;
-            return 1;
-        }
-        if (c == 'D') {
-            termchar->tch_ctrl.value = TCHCTRL_BCKWARD;
-            return 1;
-        }
-        if (c == 'H') {
-            termchar->tch_ctrl.value = TCHCTRL_HOME;
-            return 1;
-        }
-        if (c == 'F') {
-            termchar->tch_ctrl.value = TCHCTRL_END;
-            return 1;
-        }
+    struct prompt_input prmt_input; // outlives lines, typed-ahead input belongs to the next one
 
-        return -1; // invalid char after '\e['
-    }
+    struct prompt_line prmt_line[HIST_MAX+1]; // edited lines, history is copied on first edit
+    size_t prmt_cur_row; // 0 is current line
+    size_t prmt_cur_col; // cursor as a byte offset
+    size_t prmt_cur_x;   // cursor as a display column
 
-    if (termchar->tch_ctrl.private.count != 2)
-        return -1; // invalid amount of chars after '\e[%c'
-    
-    if (c != '~')
-        return -1; // invalid char after '\e[%c'
-    
-    // termchar->tch_ctrl.private.count == 2 && c == '~'
+    size_t prmt_row_len;  // byte length of the current row while it's unedited history
+    size_t prmt_row_cols; // display columns of the current row while it's unedited history
+    size_t prmt_row_wide; // characters 2 columns wide in the current row while it's unedited history
+    struct prompt_colidx prmt_colidx;
 
-    c = termchar->tch_ctrl.private.data[1];
-    if (c == '1') {
-        termchar->tch_ctrl.value = TCHCTRL_HOME;
-        return 1;
-    }
-    if (c == '3') {
-        termchar->tch_ctrl.value = TCHCTRL_DEL;
-        return 1;
-    }
-    if (c == '4') {
-        termchar->tch_ctrl.value = TCHCTRL_END;
-        return 1;
-    }
-    if (c == '5') {
-        termchar->tch_ctrl.value = TCHCTRL_PGUP;
-        return 1;
-    }
-    if (c == '6') {
-        termchar->tch_ctrl.value = TCHCTRL_PGDN;
-        return 1;
-    }
-    if (c == '7') {
-        termchar->tch_ctrl.value = TCHCTRL_HOME;
-        return 1;
-    }
-    if (c == '8') {
-        termchar->tch_ctrl.value = TCHCTRL_END;
-        return 1;
-    }
+    char   *prmt_srch_line;
+    size_t  prmt_srch_line_sz;
+    size_t  prmt_srch_query_sz;
+
+    struct prompt_paste prmt_paste;
+    struct prompt_screen prmt_screen;
+
+    int prmt_escdelay; // ms to wait for the rest of an escape sequence, negative waits forever
+    uint32_t prmt_keynode; // keymap node of a key sequence being typed, 0 between sequences
+};
+
+static void __prompt_reset(struct prompt *p, const char *ps1) {
+    for (int i = 0; i < (HIST_MAX+1); i++)
+        if (p->prmt_line[i].buf)
+            free(p->prmt_line[i].buf);
+    if (p->prmt_srch_line)
+        free(p->prmt_srch_line);
+    if (p->prmt_paste.buf)
+        free(p->prmt_paste.buf);
+    if (p->prmt_colidx.cols)
+        free(p->prmt_colidx.cols);
+    if (p->prmt_screen.text)
+        free(p->prmt_screen.text);
+    if (p->prmt_screen.next)
+        free(p->prmt_screen.next);
+    struct prompt_input input = p->prmt_input;
+    memset(p, 0, sizeof(*p));
+    p->prmt_input = input;
+    p->prmt_ps1 = ps1;
+    p->prmt_screen.dirty = 1;
+}
 
-    return -1; // invalid character between '\e[' and '~'
+static const char *__prompt_get(struct prompt *p, size_t idx) {
+    if (idx >= (1+HIST_MAX))
+        return NULL;
+    if (p->prmt_line[idx].buf)
+        return prompt_line_str(&p->prmt_line[idx]);
+    return (idx ? history_get(idx - 1) : NULL);
 }
 
-static void __print_movecursor(int moves)
-{
-    if (moves > 0)
-        printf(VT_CURFWD_N, moves);
-    else if (moves < 0)
-        printf(VT_CURBCK_N, -moves);
+static const char *prompt_get(struct prompt *p) {
+    return __prompt_get(p, p->prmt_cur_row);
 }
 
 /**
- * if `buf=NULL`, same as `__print_movecursor(moves);`
- * reprints the entire current line and moves the cursor afterwards
+ * returns the byte length of the current line.
  */
-static void __print_redrawline(const char *ps1, const char *buf, int moves)
-{
-    if (!buf) {
-        __print_movecursor(moves);
-        return;
-    }
-    
-    if (!moves)
-        printf(VT_CURSTR VT_CURSET_C "%s%s" VT_CUREOL VT_CURLDR, 1, (ps1 ?: ""), buf);
-    else if (moves > 0)
-        printf(VT_CURSTR VT_CURSET_C "%s%s" VT_CUREOL VT_CURLDR VT_CURFWD_N, 1, (ps1 ?: ""), buf, moves);
-    else
-        printf(VT_CURSTR VT_CURSET_C "%s%s" VT_CUREOL VT_CURLDR VT_CURBCK_N, 1, (ps1 ?: ""), buf, -moves);
+static size_t __prompt_len(struct prompt *p) {
+    if (p->prmt_line[p->prmt_cur_row].buf)
+        return prompt_line_len(&p->prmt_line[p->prmt_cur_row]);
+    return p->prmt_row_len;
 }
 
 /**
- * reprints line and sets cursor to end of line.
+ * returns the display columns of the current line.
  */
-static void __print_redrawline_eol(const char *ps1, const char *buf)
-{
-    printf(VT_CURSET_C "%s%s" VT_CURSTR VT_CUREOL VT_CURLDR, 1, (ps1 ?: ""), (buf ?: ""));
+static size_t __prompt_cols(struct prompt *p) {
+    if (p->prmt_line[p->prmt_cur_row].buf)
+        return p->prmt_line[p->prmt_cur_row].cols;
+    return p->prmt_row_cols;
 }
 
 /**
- * if `buf=NULL`, same as `__print_movecursor(moves_before + moves_after);`
- * reprints data from cursor onwards to end of line.
- * if moves is positive, moves cursor AFTER redrawing.
- * if moves is negative, moves cursor BEFORE redrawing.
+ * returns non-zero if the current line has characters 2 columns wide.
  */
-static void __print_redrawcursor(const char *buf, int moves_before, int moves_after)
-{
-    if (!buf) {
-        __print_movecursor(moves_before + moves_after);
-        return;
+static int __prompt_wide(struct prompt *p) {
+    if (p->prmt_line[p->prmt_cur_row].buf)
+        return !!p->prmt_line[p->prmt_cur_row].wide;
+    return !!p->prmt_row_wide;
+}
+
+/**
+ * returns the display width of the characters starting between bytes `from` and `to` of the current line.
+ */
+static size_t __prompt_width(struct prompt *p, size_t from, size_t to) {
+    struct prompt_line *l = &p->prmt_line[p->prmt_cur_row];
+    if (!l->buf)
+        return utf8_nwidth((prompt_get(p) ?: "") + from, to - from, p->prmt_row_len - from, NULL);
+
+    // count around the gap instead of moving it, no character spans it
+    size_t cnt = 0;
+    if (from < l->gap)
+        cnt += utf8_nwidth(l->buf + from, (to < l->gap ? to : l->gap) - from, l->gap - from, NULL);
+    if (to > l->gap) {
+        if (from < l->gap)
+            from = l->gap;
+        cnt += utf8_nwidth(l->buf + l->gap_end + (from - l->gap), to - from, prompt_line_len(l) - from, NULL);
     }
+    return cnt;
+}
 
-    char moves_before_s[48] = {0};
-    char moves_after_s[48] = {0};
+/**
+ * returns the column of byte `pos` of the current line.
+ * at most PRMT_COLIDX_STEP bytes are counted once the index covers `pos`.
+ */
+static size_t __prompt_col_of(struct prompt *p, size_t pos) {
+    struct prompt_colidx *idx = &p->prmt_colidx;
+    size_t i = pos / PRMT_COLIDX_STEP;
+
+    if (pos == __prompt_len(p))
+        return __prompt_cols(p);
+
+    if (idx->cap <= i) {
+        size_t cap = (idx->cap ? idx->cap * 2 : 16);
+        while (cap <= i)
+            cap *= 2;
+        size_t *cols = realloc(idx->cols, cap * sizeof(*cols));
+        if (!cols)
+            return __prompt_width(p, 0, pos); // no index, count it all
+        idx->cols = cols;
+        idx->cap = cap;
+    }
 
-    if (moves_before > 0)
-        sprintf(moves_before_s, VT_CURFWD_N, moves_before);
-    else if (moves_before < 0)
-        sprintf(moves_before_s, VT_CURBCK_N, -moves_before);
-    
-    if (moves_after > 0)
-        sprintf(moves_after_s, VT_CURFWD_N, moves_after);
-    else if (moves_after < 0)
-        sprintf(moves_after_s, VT_CURBCK_N, -moves_after);
+    if (!idx->n)
+        idx->cols[idx->n++] = 0;
+    for (; idx->n <= i; idx->n++)
+        idx->cols[idx->n] = idx->cols[idx->n - 1] + __prompt_width(p, (idx->n - 1) * PRMT_COLIDX_STEP, idx->n * PRMT_COLIDX_STEP);
 
-    printf("%s" VT_CURSTR VT_CUREOL "%s" VT_CURLDR "%s", moves_before_s, buf, moves_after_s);
+    return idx->cols[i] + __prompt_width(p, i * PRMT_COLIDX_STEP, pos);
 }
 
 /**
- * returns 0 on success and non-zero on failure.
- * NOTE: prints to screen.
+ * drops index entries invalidated by an edit at byte `pos` of the current line.
  */
-static int __prompt_output_search(struct prompt *p, const char *s, size_t n)
-{
-    int moves = utf8_strnlen(s, n);
-    if (moves == -1)
-        return -1;
-    
-    // do nothing for empty string
-    if (!moves)
-        return -1;
-    
-    if (!(p->prmt_srch_line = realloc(p->prmt_srch_line, p->prmt_srch_line_sz + n + 1))) // 1 for \0
-        return -1;
-
-    // make room for new data in query
-    //  s = "text", n = 4
-    //  before: (reverse-search)`my': mydataisnice 
-    //  after:  (reverse-search)`my@@@@': mydataisnice 
-
-    memmove(p->prmt_srch_line + PRMT_SRCH_QSTART + p->prmt_srch_query_sz + n,
-            p->prmt_srch_line + PRMT_SRCH_QSTART + p->prmt_srch_query_sz,
-            p->prmt_srch_line_sz - (PRMT_SRCH_QSTART + p->prmt_srch_query_sz));
+static void __prompt_edited(struct prompt *p, size_t pos) {
+    p->prmt_screen.dirty = 1;
+    if (p->prmt_colidx.n > pos / PRMT_COLIDX_STEP + 1)
+        p->prmt_colidx.n = pos / PRMT_COLIDX_STEP + 1;
+}
 
-    // copy new data
-    memcpy(p->prmt_srch_line + PRMT_SRCH_QSTART + p->prmt_srch_query_sz,
-           s,
-           n);
-    
-    // put null terminator and update line size
-    p->prmt_srch_line[p->prmt_srch_line_sz + n] = 0;
-    p->prmt_srch_line_sz += n;
-    p->prmt_srch_query_sz++;
+/**
+ * moves to row `row` with the cursor at byte `col`.
+ */
+static void __prompt_set_row(struct prompt *p, size_t row, size_t col) {
+    const char *s;
+
+    p->prmt_cur_row = row;
+    p->prmt_colidx.n = 0;
+    p->prmt_screen.dirty = 1;
+    p->prmt_row_len = p->prmt_row_cols = p->prmt_row_wide = 0;
+    if (!p->prmt_line[row].buf && (s = prompt_get(p))) {
+        p->prmt_row_len = strlen(s);
+        p->prmt_row_cols = utf8_nwidth(s, p->prmt_row_len, p->prmt_row_len, &p->prmt_row_wide);
+    }
 
-    if (0 != __prompt_search(p, 0, p->prmt_srch_line + PRMT_SRCH_QSTART, p->prmt_srch_query_sz, &moves))
-        return -1; // general failure while searching
-    
-    __print_redrawline(NULL, p->prmt_srch_line, moves);
-    return 0;
+    p->prmt_cur_col = col;
+    p->prmt_cur_x = __prompt_col_of(p, col);
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen.
+ * returns the current line for editing, or NULL on error.
+ * if it's a history line, it's copied first because we never want to modify history.
  */
-static int __prompt_output_line(struct prompt *p, const char *s, size_t n)
-{
-    int moves = utf8_strnlen(s, n);
-    if (moves == -1)
-        return -1;
-    
-    // do nothing for empty string
-    if (!moves)
-        return -1;
-    
-    // if the current line is null and it isn't the initial line,
-    // it means we're on a history line, we want to copy it to the prompt lines
-    // because we never want to modify history.
+static struct prompt_line *__prompt_edit(struct prompt *p) {
+    struct prompt_line *l = &p->prmt_line[p->prmt_cur_row];
     const char *hist_line;
-    char *curr_line = p->prmt_line[p->prmt_cur_row];
-    if (!curr_line && p->prmt_cur_row && (hist_line = history_get(p->prmt_cur_row - 1))) // `-1` because prmt_line is `1+HIST_MAX`
-        if (!(curr_line = p->prmt_line[p->prmt_cur_row] = strdup(hist_line)))
-            return -1;
+    if (l->buf || !p->prmt_cur_row || !(hist_line = history_get(p->prmt_cur_row - 1))) // `-1` because prmt_line is `1+HIST_MAX`
+        return l;
 
-    // resize line to be able to fit new data
-    size_t curr_line_sz = (curr_line ? strlen(curr_line) : 0);
-    curr_line = p->prmt_line[p->prmt_cur_row] = realloc(curr_line, curr_line_sz + n + 1); // 1 for \0
-    if (!curr_line)
-        return -1;
-    
-    // make room for new data, copy data to there and then put a null terminator
-    memmove(curr_line + p->prmt_cur_col + n, curr_line + p->prmt_cur_col, curr_line_sz - p->prmt_cur_col);
-    memcpy(curr_line + p->prmt_cur_col, s, n);
-    curr_line[curr_line_sz + n] = 0;
+    if (prompt_line_insert(l, 0, hist_line, p->prmt_row_len))
+        return NULL;
+    return l;
+}
 
-    __print_redrawcursor(curr_line + p->prmt_cur_col, 0, moves);
-    p->prmt_cur_col += n;
+/**
+ * returns the text after the cursor (null terminated) of the current line.
+ */
+static const char *__prompt_after(struct prompt *p) {
+    struct prompt_line *l = &p->prmt_line[p->prmt_cur_row];
+    if (!l->buf)
+        return (prompt_get(p) ?: "") + p->prmt_cur_col;
+    prompt_line_seek(l, p->prmt_cur_col);
+    return l->buf + l->gap_end;
+}
 
-    return 0;
+/**
+ * returns the text before the cursor (`prmt_cur_col` bytes, not null terminated) of the current line.
+ */
+static const char *__prompt_before(struct prompt *p) {
+    struct prompt_line *l = &p->prmt_line[p->prmt_cur_row];
+    if (!l->buf)
+        return (prompt_get(p) ?: "");
+    prompt_line_seek(l, p->prmt_cur_col);
+    return l->buf;
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen.
+ * returns 0 on succes
+ * returns -1 on error
+ * NOTE: this modifies the internal state of `p`, including cursor position
  */
-static int __prompt_output_enter_search(struct prompt *p)
+static int __prompt_search(struct prompt *p, size_t start_idx, const void *needle, size_t needle_len) {
+    const char *s, *f;
+    size_t n;
+
+    size_t idx;
+    size_t pos;
+    int found = 0;
+
+    for (size_t i = start_idx; i < (1+HIST_MAX); i++) {
+        s = __prompt_get(p, i);
+        n = (s ? strlen(s) : 0);
+
+        if (n < needle_len)
+            continue;
+        
+        f = (const char *)memmem(s, n, needle, needle_len);
+        if (!f)
+            continue;
+        
+        idx = i;
+        pos = ((size_t)f) - (size_t)s;
+        found = 1;
+        break;
+    }
+
+    // not found, just return success without doing anything
+    if (!found)
+        return 0;
+
+    // replace old result with new result in search line, and make sure is null terminated
+    if (!(p->prmt_srch_line = realloc(p->prmt_srch_line, PRMT_SRCH_TLEN + p->prmt_srch_query_sz + n + 1))) // +1 for \0
+        return -1;
+    memcpy(p->prmt_srch_line + PRMT_SRCH_TLEN + p->prmt_srch_query_sz, s, n);
+    p->prmt_srch_line[PRMT_SRCH_TLEN + p->prmt_srch_query_sz + n] = 0;
+    p->prmt_srch_line_sz = PRMT_SRCH_TLEN + p->prmt_srch_query_sz + n;
+    
+    __prompt_set_row(p, idx, pos);
+    return 0;
+}
+
+#define ECHO_CNTRL(C) prompt_frame_printf("^%c", 'A'+C-1)
+
+enum {
+    TCHTYPE_UNK = 0,
+    TCHTYPE_TEXT,
+    TCHTYPE_CTRL,
+};
+
+enum {
+    TCHCTRL_UNK = 0, // a well formed sequence of a key that isn't known
+
+    TCHCTRL_DEL,
+
+    TCHCTRL_HOME,
+    TCHCTRL_END,
+    TCHCTRL_BCKWARD,
+    TCHCTRL_FORWARD,
+
+    TCHCTRL_UP,
+    TCHCTRL_DN,
+    TCHCTRL_PGUP,
+    TCHCTRL_PGDN,
+
+    TCHCTRL_PASTE_START,
+    TCHCTRL_PASTE_END,
+
+    TCHCTRL_REPORT, // a sequence with a private marker, which only the terminal sends in answer to a query
+
+    TCHCTRL_C0 = 0x100, // control characters are keys of their own, TCHCTRL_C0 + the character
+};
+
+// modifiers, with the bits xterm encodes as the last CSI parameter minus one
+enum {
+    TCHMOD_SHIFT = 0x01,
+    TCHMOD_ALT   = 0x02,
+    TCHMOD_CTRL  = 0x04,
+    TCHMOD_META  = 0x08,
+};
+
+#define TCH_PARAMS 4 // CSI parameters kept, the rest are ignored
+
+struct __termchar {
+    uint8_t       tch_type;  // TCHTYPE_*
+    uint8_t       tch_state; // TCHSTATE_*, where the decoder is
+    uint8_t       tch_mods;  // TCHMOD_*
+    union {
+        struct {
+            char data[5];
+            uint8_t in;
+            uint8_t sz;
+        } tch_text;
+        struct {
+            struct {
+                uint16_t param[TCH_PARAMS];
+                uint8_t  count; // parameters started, so "\e[;5C" has 2
+                uint8_t  inter; // intermediate byte, 0 if none
+                uint8_t  priv;  // private marker ('<' to '?'), 0 if none
+                uint8_t  final; // final byte of a TCHCTRL_REPORT
+            } private;
+            uint16_t value;
+        } tch_ctrl;
+    };
+};
+
+/**
+ * the decoder is a DFA: each byte is mapped to a class, and the state and the class pick the next state
+ * and an action. tables are built by the compiler, decoding a byte is two lookups and the action.
+ */
+enum {
+    TCHSTATE_GROUND = 0, // between keys
+    TCHSTATE_TEXT,       // inside a utf8 character
+    TCHSTATE_ESC,        // after '\e'
+    TCHSTATE_CSI,        // after '\e[', reading parameters
+    TCHSTATE_SS3,        // after '\eO'
+    TCHSTATE_CNT,
+};
+
+enum {
+    TCHCLS_CTRL = 0, // C0 controls and DEL
+    TCHCLS_ESC,
+    TCHCLS_DIGIT,
+    TCHCLS_SEP,      // ';' and ':'
+    TCHCLS_INTER,    // intermediate (0x20-0x2f) and private (0x3c-0x3f) bytes
+    TCHCLS_LBRACKET,
+    TCHCLS_O,
+    TCHCLS_FINAL,    // 0x40-0x7e
+    TCHCLS_LEAD,     // utf8 leading byte
+    TCHCLS_CONT,     // utf8 continuation byte
+    TCHCLS_BAD,
+    TCHCLS_CNT,
+};
+
+enum {
+    TCHACT_ERR = 0,
+    TCHACT_ESC,       // start of an escape sequence, or of an alt-prefixed key
+    TCHACT_CTRL,      // control character
+    TCHACT_TEXT,      // first byte of a character
+    TCHACT_TEXT_CONT, // continuation byte of a character
+    TCHACT_SEQ,       // introducer of a CSI or SS3 sequence
+    TCHACT_PARAM,     // parameter digit
+    TCHACT_SEP,       // parameter separator
+    TCHACT_INTER,     // intermediate byte
+    TCHACT_FINAL,     // final byte of a CSI or SS3 sequence
+};
+
+static const uint8_t tch_class[256] = {
+    [0x00 ... 0x1a] = TCHCLS_CTRL,
+    ['\e']          = TCHCLS_ESC,
+    [0x1c ... 0x1f] = TCHCLS_CTRL,
+    [0x20 ... 0x2f] = TCHCLS_INTER,
+    ['0' ... '9']   = TCHCLS_DIGIT,
+    [':']           = TCHCLS_SEP,
+    [';']           = TCHCLS_SEP,
+    ['<' ... '?']   = TCHCLS_INTER,
+    ['@' ... 'N']   = TCHCLS_FINAL,
+    ['O']           = TCHCLS_O,
+    ['P' ... 'Z']   = TCHCLS_FINAL,
+    ['[']           = TCHCLS_LBRACKET,
+    ['\\' ... '~']  = TCHCLS_FINAL,
+    [0x7f]          = TCHCLS_CTRL,
+    [0x80 ... 0xbf] = TCHCLS_CONT,
+    [0xc0 ... 0xf7] = TCHCLS_LEAD,
+    [0xf8 ... 0xff] = TCHCLS_BAD,
+};
+
+struct tch_trans {
+    uint8_t next; // TCHSTATE_*
+    uint8_t act;  // TCHACT_*
+};
+
+#define TCH_TO(State, Act) { TCHSTATE_##State, TCHACT_##Act }
+
+static const struct tch_trans tch_dfa[TCHSTATE_CNT][TCHCLS_CNT] = {
+    [TCHSTATE_GROUND] = {
+        [TCHCLS_CTRL]     = TCH_TO(GROUND, CTRL),
+        [TCHCLS_ESC]      = TCH_TO(ESC, ESC),
+        [TCHCLS_DIGIT]    = TCH_TO(GROUND, TEXT),
+        [TCHCLS_SEP]      = TCH_TO(GROUND, TEXT),
+        [TCHCLS_INTER]    = TCH_TO(GROUND, TEXT),
+        [TCHCLS_LBRACKET] = TCH_TO(GROUND, TEXT),
+        [TCHCLS_O]        = TCH_TO(GROUND, TEXT),
+        [TCHCLS_FINAL]    = TCH_TO(GROUND, TEXT),
+        [TCHCLS_LEAD]     = TCH_TO(TEXT, TEXT),
+    },
+    [TCHSTATE_TEXT] = {
+        [TCHCLS_CONT]     = TCH_TO(TEXT, TEXT_CONT),
+    },
+    // anything but an introducer is a key pressed with alt
+    [TCHSTATE_ESC] = {
+        [TCHCLS_CTRL]     = TCH_TO(GROUND, CTRL),
+        [TCHCLS_ESC]      = TCH_TO(GROUND, CTRL),
+        [TCHCLS_DIGIT]    = TCH_TO(GROUND, TEXT),
+        [TCHCLS_SEP]      = TCH_TO(GROUND, TEXT),
+        [TCHCLS_INTER]    = TCH_TO(GROUND, TEXT),
+        [TCHCLS_LBRACKET] = TCH_TO(CSI, SEQ),
+        [TCHCLS_O]        = TCH_TO(SS3, SEQ),
+        [TCHCLS_FINAL]    = TCH_TO(GROUND, TEXT),
+        [TCHCLS_LEAD]     = TCH_TO(TEXT, TEXT),
+    },
+    // '[' is an intermediate here, for the function keys of the linux console ("\e[[A")
+    [TCHSTATE_CSI] = {
+        [TCHCLS_DIGIT]    = TCH_TO(CSI, PARAM),
+        [TCHCLS_SEP]      = TCH_TO(CSI, SEP),
+        [TCHCLS_INTER]    = TCH_TO(CSI, INTER),
+        [TCHCLS_LBRACKET] = TCH_TO(CSI, INTER),
+        [TCHCLS_O]        = TCH_TO(GROUND, FINAL),
+        [TCHCLS_FINAL]    = TCH_TO(GROUND, FINAL),
+    },
+    // some terminals send modifiers as a parameter ("\eO5C")
+    [TCHSTATE_SS3] = {
+        [TCHCLS_DIGIT]    = TCH_TO(SS3, PARAM),
+        [TCHCLS_LBRACKET] = TCH_TO(GROUND, FINAL),
+        [TCHCLS_O]        = TCH_TO(GROUND, FINAL),
+        [TCHCLS_FINAL]    = TCH_TO(GROUND, FINAL),
+    },
+};
+
+// keys of the final byte of CSI and SS3 sequences ("\e[A", "\eOA")
+static const uint16_t tch_final_keys[128] = {
+    ['A'] = TCHCTRL_UP,
+    ['B'] = TCHCTRL_DN,
+    ['C'] = TCHCTRL_FORWARD,
+    ['D'] = TCHCTRL_BCKWARD,
+    ['H'] = TCHCTRL_HOME,
+    ['F'] = TCHCTRL_END,
+    ['Z'] = TCHCTRL_C0 + '\t', // shift is set by the terminal as a parameter, or not at all
+};
+
+// keys of the first parameter of CSI sequences ending with '~' ("\e[3~")
+static const uint8_t tch_tilde_keys[256] = {
+    [1]   = TCHCTRL_HOME,
+    [3]   = TCHCTRL_DEL,
+    [4]   = TCHCTRL_END,
+    [5]   = TCHCTRL_PGUP,
+    [6]   = TCHCTRL_PGDN,
+    [7]   = TCHCTRL_HOME,
+    [8]   = TCHCTRL_END,
+    [200] = TCHCTRL_PASTE_START,
+    [201] = TCHCTRL_PASTE_END,
+};
+
+/**
+ * decodes byte `c` of a key into `termchar`, which starts zeroed.
+ * escape sequences are decoded whole, with any parameters and modifiers ("\e[1;5C" is ctrl+forward),
+ * and sequences of unknown keys decode as TCHCTRL_UNK so none of their bytes end up as text.
+ * returns: 1 on success, 0 if needs to read more or -1 on failure
+ */
+static int __termchar_input(struct __termchar *termchar, int c)
+{
+    const struct tch_trans *t = &tch_dfa[termchar->tch_state][tch_class[(unsigned char)c]];
+    uint16_t *param = termchar->tch_ctrl.private.param;
+    uint8_t count = termchar->tch_ctrl.private.count;
+    int ss3 = (termchar->tch_state == TCHSTATE_SS3);
+
+    termchar->tch_state = t->next;
+
+    if (t->act == TCHACT_ESC) {
+        termchar->tch_type = TCHTYPE_CTRL;
+        termchar->tch_mods = TCHMOD_ALT; // unless a sequence follows
+        return 0;
+    }
+
+    if (t->act == TCHACT_CTRL) {
+        termchar->tch_type = TCHTYPE_CTRL;
+        termchar->tch_ctrl.value = TCHCTRL_C0 + c;
+        return 1;
+    }
+
+    if (t->act == TCHACT_TEXT) {
+        termchar->tch_type = TCHTYPE_TEXT;
+        termchar->tch_text.data[0] = c;
+        termchar->tch_text.in = 1;
+        termchar->tch_text.sz = utf8_size(c);
+        if (termchar->tch_text.sz > 1)
+            return 0; // need more chars
+        termchar->tch_text.data[1] = 0;
+        return 1;
+    }
+
+    if (t->act == TCHACT_TEXT_CONT) {
+        termchar->tch_text.data[termchar->tch_text.in++] = c;
+        if (termchar->tch_text.in < termchar->tch_text.sz)
+            return 0; // `in < sz`, need more data
+        termchar->tch_text.data[termchar->tch_text.sz] = 0;
+        termchar->tch_state = TCHSTATE_GROUND;
+        return 1; // finished reading
+    }
+
+    if (t->act == TCHACT_SEQ) {
+        termchar->tch_mods = 0;
+        return 0;
+    }
+
+    if (t->act == TCHACT_PARAM) {
+        if (!count)
+            termchar->tch_ctrl.private.count = count = 1;
+        if (count <= TCH_PARAMS && param[count - 1] < 10000) // saturates, no key has a parameter that large
+            param[count - 1] = param[count - 1] * 10 + (c - '0');
+        return 0;
+    }
+
+    if (t->act == TCHACT_SEP) {
+        if (count < UINT8_MAX)
+            termchar->tch_ctrl.private.count = (count ?: 1) + 1;
+        return 0;
+    }
+
+    if (t->act == TCHACT_INTER) {
+        if (c >= '<' && c <= '?')
+            termchar->tch_ctrl.private.priv = c;
+        else
+            termchar->tch_ctrl.private.inter = c;
+        return 0;
+    }
+
+    if (t->act != TCHACT_FINAL)
+        return -1; // invalid byte for the state
+
+    // TCHACT_FINAL, modifiers are the second parameter ("\e[1;5C", "\e[3;5~") or the only one of SS3 ("\eO5C")
+    int mods = (ss3 ? (count ? param[0] : 0) : (count > 1 ? param[1] : 0));
+    if (mods > 1)
+        termchar->tch_mods |= (mods - 1) & 0xf;
+
+    if (termchar->tch_ctrl.private.priv) {
+        termchar->tch_ctrl.value = TCHCTRL_REPORT; // private sequences aren't keys
+        termchar->tch_ctrl.private.final = c;
+    }
+    else if (termchar->tch_ctrl.private.inter)
+        termchar->tch_ctrl.value = TCHCTRL_UNK;
+    else if (c == '~')
+        termchar->tch_ctrl.value = (count && param[0] < 256 ? tch_tilde_keys[param[0]] : TCHCTRL_UNK);
+    else
+        termchar->tch_ctrl.value = tch_final_keys[c];
+    return 1;
+}
+
+/**
+ * returns non-zero if `termchar` is in the middle of an escape sequence.
+ */
+static int __termchar_escape(const struct __termchar *termchar)
+{
+    return (termchar->tch_state == TCHSTATE_ESC || termchar->tch_state == TCHSTATE_CSI || termchar->tch_state == TCHSTATE_SS3);
+}
+
+/**
+ * ends the escape sequence being decoded in `termchar`, when the rest of it didn't come in time.
+ * a lone '\e' is the escape key, "\e[" and "\eO" are '[' and 'O' pressed with alt.
+ * returns: 1 on success or -1 if the partial sequence is dropped
+ */
+static int __termchar_timeout(struct __termchar *termchar)
+{
+    int state = termchar->tch_state;
+
+    termchar->tch_state = TCHSTATE_GROUND;
+    if (state == TCHSTATE_ESC) {
+        termchar->tch_mods = 0;
+        termchar->tch_ctrl.value = TCHCTRL_C0 + '\e';
+        return 1;
+    }
+
+    if (termchar->tch_ctrl.private.count || termchar->tch_ctrl.private.inter || termchar->tch_ctrl.private.priv)
+        return -1; // parameters came, it was a sequence
+
+    termchar->tch_type = TCHTYPE_TEXT;
+    termchar->tch_mods = TCHMOD_ALT;
+    termchar->tch_text.data[0] = (state == TCHSTATE_CSI ? '[' : 'O');
+    termchar->tch_text.data[1] = 0;
+    termchar->tch_text.in = termchar->tch_text.sz = 1;
+    return 1;
+}
+
+#define PRMT_ESCDELAY 100 // default of RMSH_ESCDELAY
+
+/**
+ * returns the ms to wait for the rest of an escape sequence, from RMSH_ESCDELAY.
+ */
+static int __prompt_escdelay(void)
+{
+    const char *env = getenv("RMSH_ESCDELAY");
+    char *end;
+
+    if (!env || !*env)
+        return PRMT_ESCDELAY;
+
+    long ms = strtol(env, &end, 10);
+    if (*end || ms > INT_MAX)
+        return PRMT_ESCDELAY;
+    return (ms < 0 ? -1 : ms);
+}
+
+/**
+ * log-linear histogram of nanoseconds: exact below 16, then 8 buckets per power of 2,
+ * so any value is known within 12.5% in constant space.
+ */
+#define PRMT_HIST_SUB     8
+#define PRMT_HIST_BUCKETS (16 + (64 - 4) * PRMT_HIST_SUB)
+
+struct prompt_hist {
+    size_t   count[PRMT_HIST_BUCKETS];
+    size_t   n;
+    uint64_t max;
+    uint64_t sum;
+};
+
+static size_t prompt_hist_bucket(uint64_t ns)
+{
+    if (ns < 16)
+        return ns;
+    int e = 63 - __builtin_clzll(ns);
+    return 16 + (e - 4) * PRMT_HIST_SUB + ((ns >> (e - 3)) & (PRMT_HIST_SUB - 1));
+}
+
+/**
+ * returns the largest value falling in bucket `b`.
+ */
+static uint64_t prompt_hist_upper(size_t b)
+{
+    if (b < 16)
+        return b;
+    int e = (b - 16) / PRMT_HIST_SUB + 4;
+    uint64_t lo = (uint64_t)(PRMT_HIST_SUB + (b - 16) % PRMT_HIST_SUB) << (e - 3);
+    return lo + ((uint64_t)1 << (e - 3)) - 1;
+}
+
+/**
+ * records `n` samples of `ns`.
+ */
+static void prompt_hist_add(struct prompt_hist *h, uint64_t ns, size_t n)
+{
+    h->count[prompt_hist_bucket(ns)] += n;
+    h->n += n;
+    h->sum += ns * n;
+    if (ns > h->max)
+        h->max = ns;
+}
+
+/**
+ * returns the `q` quantile (0 to 1), rounded up to its bucket but never past the max.
+ */
+static uint64_t prompt_hist_quantile(const struct prompt_hist *h, double q)
+{
+    size_t rank = (size_t)(q * h->n + 0.5), seen = 0;
+    if (!rank)
+        rank = 1;
+    for (size_t b = 0; b < PRMT_HIST_BUCKETS; b++) {
+        if ((seen += h->count[b]) >= rank) {
+            uint64_t v = prompt_hist_upper(b);
+            return (v < h->max ? v : h->max);
+        }
+    }
+    return h->max;
+}
+
+/**
+ * counters of the interactive prompt, reported by the `promptstat` builtin.
+ */
+struct prompt_stat {
+    size_t keys;   // decoded keys (a bracketed paste counts as one)
+    size_t frames; // flushed frames
+    size_t writes; // write syscalls
+    size_t bytes;  // bytes written
+    size_t skipped; // frames not rendered because more keys were already pending
+    struct prompt_hist latency; // per key, from the read() that completed it to its frame being written
+};
+
+static struct prompt_stat prompt_stat;
+
+/**
+ * returns the nanoseconds since `since`.
+ */
+static uint64_t prompt_stat_since(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000000 + now.tv_nsec - since->tv_nsec;
+}
+
+/**
+ * prints the counters and latency quantiles to `fd`, with every latency bucket if `buckets`.
+ */
+static void prompt_stat_print(int fd, int buckets)
+{
+    const struct prompt_stat *st = &prompt_stat;
+    const struct prompt_hist *h = &st->latency;
+    double keys = (st->keys ? st->keys : 1), frames = (st->frames ? st->frames : 1);
+    dprintf(fd,
+            "keys        %zu\n"
+            "frames      %zu\n"
+            "writes      %zu\n"
+            "bytes       %zu\n"
+            "skipped     %zu\n"
+            "writes/key  %.2f\n"
+            "bytes/key   %.1f\n"
+            "bytes/frame %.1f\n"
+            "p50 us      %.1f\n"
+            "p99 us      %.1f\n"
+            "max us      %.1f\n",
+            st->keys, st->frames, st->writes, st->bytes, st->skipped,
+            st->writes / keys, st->bytes / keys, st->bytes / frames,
+            prompt_hist_quantile(h, 0.50) / 1e3, prompt_hist_quantile(h, 0.99) / 1e3, h->max / 1e3);
+
+    for (size_t b = 0; buckets && b < PRMT_HIST_BUCKETS; b++)
+        if (h->count[b])
+            dprintf(fd, "<= %-8.1f  %zu\n", prompt_hist_upper(b) / 1e3, h->count[b]);
+}
+
+/**
+ * everything the prompt prints for a key is assembled here and flushed with a single write,
+ * instead of depending on how stdout happens to be buffered.
+ */
+struct prompt_frame {
+    char  *buf;
+    size_t len;
+    size_t cap;
+    int    err;  // a write didn't fit, the next flush fails
+    int    sync; // a synchronized update was begun, the flush ends it
+};
+
+static struct prompt_frame prompt_frame;
+
+/**
+ * features of the terminal, learnt from its answers to the queries sent by the first prompt,
+ * or from what was learnt for the same $TERM before (see prompt_term_load()).
+ * terminals that share a $TERM are told apart by their DA2 answer, which is asked for even on a cache hit.
+ */
+struct prompt_term {
+    int queried;
+    int known;       // every answer came or the cache had them
+    int paste;       // bracketed paste (mode 2004), -1 while unknown, it's enabled unless known to be missing
+    int sync;        // synchronized output (mode 2026)
+    int da2_type;    // terminal type (Pp) of the DA2 answer, -1 without one
+    int da2_version; // and its version (Pv)
+};
+
+static struct prompt_term prompt_term = {.paste = -1, .da2_type = -1, .da2_version = -1};
+
+// what's cached, as "name value" lines
+static const struct {
+    const char *name;
+    size_t      off;
+} prompt_term_fields[] = {
+    {"paste",       offsetof(struct prompt_term, paste)},
+    {"sync",        offsetof(struct prompt_term, sync)},
+    {"da2_type",    offsetof(struct prompt_term, da2_type)},
+    {"da2_version", offsetof(struct prompt_term, da2_version)},
+};
+
+#define PRMT_TERM_FIELDS (sizeof(prompt_term_fields) / sizeof(*prompt_term_fields))
+
+static int *prompt_term_field(struct prompt_term *t, size_t i)
+{
+    return (int *)((char *)t + prompt_term_fields[i].off);
+}
+
+/**
+ * returns the path of the cache of features of $TERM in `buf` (`n` bytes), or NULL if it has none.
+ */
+static const char *prompt_term_path(char *buf, size_t n)
+{
+    const char *term = getenv("TERM"), *cache = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    int len;
+
+    if (!term || !*term || strchr(term, '/') || !strcmp(term, "dumb"))
+        return NULL;
+    if (cache && *cache == '/')
+        len = snprintf(buf, n, "%s/rmsh/term-%s", cache, term);
+    else if (home && *home)
+        len = snprintf(buf, n, "%s/.cache/rmsh/term-%s", home, term);
+    else
+        return NULL;
+    return (len > 0 && (size_t)len < n ? buf : NULL);
+}
+
+/**
+ * reads the features cached for $TERM.
+ * returns 0 on success and -1 if there are none.
+ */
+static int prompt_term_load(void)
+{
+    struct prompt_term t = prompt_term;
+    char path[PATH_MAX], line[64], name[16];
+    int value, seen = 0;
+    FILE *f;
+
+    if (!prompt_term_path(path, sizeof(path)) || !(f = fopen(path, "re")))
+        return -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (2 != sscanf(line, "%15s %d", name, &value))
+            continue;
+        for (size_t i = 0; i < PRMT_TERM_FIELDS; i++) {
+            if (strcmp(name, prompt_term_fields[i].name))
+                continue;
+            *prompt_term_field(&t, i) = value;
+            seen |= 1 << i;
+        }
+    }
+    fclose(f);
+
+    // a cache from another version misses features, they're asked for again
+    if (seen != (1 << PRMT_TERM_FIELDS) - 1)
+        return -1;
+    prompt_term = t;
+    prompt_term.known = 1;
+    return 0;
+}
+
+/**
+ * writes the features of the terminal to the cache of $TERM, quietly giving up on errors.
+ * it's written aside and renamed, so shells starting meanwhile never read half of it.
+ */
+static void prompt_term_save(void)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    char *slash;
+    FILE *f;
+
+    if (!prompt_term_path(path, sizeof(path)))
+        return;
+
+    // ~/.cache/rmsh, and ~/.cache if it's missing too
+    slash = strrchr(path, '/');
+    *slash = 0;
+    if (mkdir(path, 0700) && errno == ENOENT) {
+        char *parent = strrchr(path, '/');
+        *parent = 0;
+        mkdir(path, 0700);
+        *parent = '/';
+        mkdir(path, 0700);
+    }
+    *slash = '/';
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if (!(f = fopen(tmp, "we")))
+        return;
+    for (size_t i = 0; i < PRMT_TERM_FIELDS; i++)
+        fprintf(f, "%s %d\n", prompt_term_fields[i].name, *prompt_term_field(&prompt_term, i));
+    if (fclose(f) || rename(tmp, path))
+        unlink(tmp);
+}
+
+
+/**
+ * returns 0 if `n` more bytes fit in the frame and -1 otherwise.
+ */
+static int prompt_frame_reserve(size_t n)
+{
+    struct prompt_frame *f = &prompt_frame;
+    if (f->len + n <= f->cap)
+        return 0;
+
+    size_t cap = (f->cap ? f->cap * 2 : 4096);
+    while (cap < f->len + n)
+        cap *= 2;
+    char *buf = realloc(f->buf, cap);
+    if (!buf) {
+        f->err = 1;
+        return -1;
+    }
+    f->buf = buf;
+    f->cap = cap;
+    return 0;
+}
+
+static void prompt_frame_write(const char *s, size_t n)
+{
+    if (prompt_frame_reserve(n))
+        return;
+    memcpy(prompt_frame.buf + prompt_frame.len, s, n);
+    prompt_frame.len += n;
+}
+
+static void prompt_frame_puts(const char *s)
+{
+    prompt_frame_write(s, strlen(s));
+}
+
+static void prompt_frame_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void prompt_frame_printf(const char *fmt, ...)
+{
+    struct prompt_frame *f = &prompt_frame;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(f->buf + f->len, f->cap - f->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        f->err = 1;
+        return;
+    }
+
+    if (f->len + n >= f->cap) {
+        // didn't fit, grow and format again
+        if (prompt_frame_reserve(n + 1))
+            return;
+        va_start(ap, fmt);
+        vsnprintf(f->buf + f->len, f->cap - f->len, fmt, ap);
+        va_end(ap);
+    }
+    f->len += n;
+}
+
+/**
+ * makes the rest of the frame a synchronized update if the terminal has them,
+ * so a redraw made of several steps is shown at once instead of as it's drawn.
+ */
+static void prompt_frame_sync(void)
+{
+    if (!prompt_term.sync || prompt_frame.sync)
+        return;
+    prompt_frame_puts(VT_SYNC_ON);
+    prompt_frame.sync = 1;
+}
+
+/**
+ * looks the features of the terminal up in the cache, or asks the terminal for them.
+ * a cache hit only asks which terminal it is, to check it's the one the cache was learnt from.
+ * the answers come as input, so it must be raw by then.
+ */
+static void prompt_term_query(void)
+{
+    if (prompt_term.queried)
+        return;
+    prompt_term.queried = 1;
+    if (!prompt_term_load()) {
+        prompt_frame_puts(VT_DA2_QUERY);
+        return;
+    }
+
+    prompt_frame_puts(VT_PASTE_QUERY VT_SYNC_QUERY VT_DA2_QUERY VT_DA_QUERY);
+}
+
+/**
+ * ends what the frame began, so it's complete.
+ */
+static void prompt_frame_end(void)
+{
+    if (prompt_frame.sync)
+        prompt_frame_puts(VT_SYNC_OFF);
+    prompt_frame.sync = 0;
+}
+
+/**
+ * writes the frame to `fd` with a single write (more only on short writes).
+ * returns 0 on success and -1 on error.
+ */
+static int prompt_frame_flush(int fd)
+{
+    struct prompt_frame *f = &prompt_frame;
+    size_t off = 0;
+    ssize_t n;
+    int ret = -1;
+
+    prompt_frame_end();
+    if (f->err)
+        goto out;
+
+    // anything the shell printed with stdio goes first
+    fflush(stdout);
+
+    if (f->len)
+        prompt_stat.frames++;
+    while (off < f->len) {
+        n = write(fd, f->buf + off, f->len - off);
+        prompt_stat.writes++;
+        if (n == -1 && errno == EINTR)
+            continue;
+        ASSERT_PERROR(n != -1, "write");
+        off += n;
+        prompt_stat.bytes += n;
+    }
+
+    ret = 0;
+out:
+    f->len = 0;
+    f->err = 0;
+    return ret;
+}
+
+static int write_all(int fd, const void *buf, size_t n);
+
+/**
+ * prints every byte read as it's typed until ^D, then the counters of the prompt.
+ * each read is echoed in one frame, so the latencies are those of the terminal and the frame alone.
+ * if `keylog` isn't NULL, the bytes before ^D are also written to it, to be replayed with `-p`.
+ */
+static int debug_prompt(struct termios *termios_p, const char *keylog)
+{
+    int ret = 1, done = 0, logfd = -1;
+    struct termios raw_termios;
+    struct timespec read_at;
+    unsigned char buf[256];
+    ssize_t n, i;
+
+    memcpy(&raw_termios, termios_p, sizeof(raw_termios));
+    raw_termios.c_iflag &= ~(IXON);
+    raw_termios.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    if (keylog)
+        ASSERT_PERROR(-1 != (logfd = open(keylog, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)), keylog);
+    ASSERT_PERROR(tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_termios) == 0, "tcsetattr");
+
+    while (!done) {
+        n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n == -1 && errno == EINTR)
+            continue;
+        ASSERT_PERROR(n != -1, "read");
+        clock_gettime(CLOCK_MONOTONIC, &read_at);
+        done = !n;
+
+        for (i = 0; i < n && !done; i++) {
+            int c = buf[i];
+            if (iscntrl(c))
+                prompt_frame_printf("\\0%x %d\n", c, c);
+            else
+                prompt_frame_printf("\\0%x %d '%c'\n", c, c, c);
+            done = (c == CTRL_D);
+        }
+        if (logfd != -1 && i - done > 0)
+            ASSERT_PERROR(0 == write_all(logfd, buf, i - done), keylog);
+
+        ASSERT_PERROR(prompt_frame_flush(STDOUT_FILENO) == 0, "prompt_frame_flush");
+        prompt_stat.keys += i;
+        if (i)
+            prompt_hist_add(&prompt_stat.latency, prompt_stat_since(&read_at), i);
+    }
+
+    ret = 0;
+out:
+    tcsetattr(STDIN_FILENO, TCSADRAIN, termios_p);
+    if (logfd != -1)
+        close(logfd);
+    prompt_stat_print(STDOUT_FILENO, 0);
+    return ret;
+}
+
+/**
+ * returns the cell after laying out `n` bytes of `s` from cell `cell`, on rows of `width` cells.
+ * cells are counted row after row, so cell `c` is on row `c / width` and column `c % width`.
+ * a character 2 columns wide doesn't fit the last column, terminals leave it empty and wrap.
+ * one wider than the screen doesn't fit at all, terminals drop it.
+ */
+static size_t __render_layout(const char *s, size_t n, size_t cell, size_t width)
+{
+    uint32_t cp;
+    int w;
+
+    for (size_t i = 0; i < n; ) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c < 0x7f) {
+            cell++;
+            i++;
+            continue;
+        }
+        if (c == '\n' || (c & 0xc0) == 0x80) {
+            // after a character that filled its row, the cursor waits on it and a line break just wraps
+            if (c == '\n' && !(cell % width == 0 && i && s[i - 1] != '\n'))
+                cell = (cell / width + 1) * width;
+            i++;
+            continue;
+        }
+        i += utf8_decode(s + i, n - i, &cp);
+        if ((size_t)(w = utf8_cpwidth(cp)) > width)
+            continue; // terminals drop what can't fit a row
+        if (w == 2 && cell % width == width - 1)
+            cell++;
+        cell += w;
+    }
+    return cell;
+}
+
+/**
+ * moves the cursor from cell `from` to cell `to`, on rows of `width` cells.
+ */
+static void __render_move(size_t from, size_t to, size_t width)
+{
+    size_t from_row = from / width, to_row = to / width;
+    from %= width;
+    to %= width;
+
+    if (to_row < from_row)
+        prompt_frame_printf(VT_CURUP_N, (int)(from_row - to_row));
+    else if (to_row > from_row)
+        prompt_frame_printf(VT_CURDN_N, (int)(to_row - from_row));
+
+    if (to == from)
+        return;
+    if (!to)
+        prompt_frame_puts("\r");
+    else if (to + 1 == from)
+        prompt_frame_puts("\b");
+    else if (to < from)
+        prompt_frame_printf(VT_CURBCK_N, (int)(from - to));
+    else if (to == from + 1)
+        prompt_frame_puts(VT_CURFWD);
+    else
+        prompt_frame_printf(VT_CURFWD_N, (int)(to - from));
+}
+
+/**
+ * returns 0 if `n` bytes of `s` were appended to the next frame of `scr` and -1 on error.
+ */
+static int __render_append(struct prompt_screen *scr, const char *s, size_t n)
+{
+    if (scr->next_len + n > scr->next_cap) {
+        size_t cap = (scr->next_cap ? scr->next_cap * 2 : 256);
+        while (cap < scr->next_len + n)
+            cap *= 2;
+        char *next = realloc(scr->next, cap);
+        if (!next)
+            return -1;
+        scr->next = next;
+        scr->next_cap = cap;
+    }
+    memcpy(scr->next + scr->next_len, s, n);
+    scr->next_len += n;
+    return 0;
+}
+
+/**
+ * returns the length of the common head of `a` and `b`, both `n` bytes long.
+ */
+static size_t __render_prefix(const char *a, const char *b, size_t n)
+{
+    size_t i = 0;
+    while (i + 64 <= n && !memcmp(a + i, b + i, 64))
+        i += 64;
+    while (i < n && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/**
+ * returns the length of the common tail of `a` and `b` (which end at `a + alen` and `b + blen`), at most `n`.
+ */
+static size_t __render_suffix(const char *a, size_t alen, const char *b, size_t blen, size_t n)
+{
+    size_t i = 0;
+    while (i + 64 <= n && !memcmp(a + alen - i - 64, b + blen - i - 64, 64))
+        i += 64;
+    while (i < n && a[alen - i - 1] == b[blen - i - 1])
+        i++;
+    return i;
+}
+
+#define PRMT_ELLIPSIS "\xe2\x80\xa6" // U+2026, a single column
+
+/**
+ * returns the byte offset of the character of the current line that starts at column `x`.
+ * if a wide character covers `x` instead, the one after it is taken when `up` is set, or that one otherwise.
+ * the column it starts at is returned via `out_x`.
+ * it's found by walking from the cursor, so it costs the distance between them.
+ */
+static size_t __prompt_byte_of(struct prompt *p, size_t x, int up, size_t *out_x)
+{
+    size_t col = p->prmt_cur_col, cx = p->prmt_cur_x, w;
+    ssize_t cnt;
+    const char *s;
+
+    if (x < cx) {
+        s = __prompt_before(p);
+        while (col && cx > x) {
+            if ((cnt = utf8_prev(s, col, &w)) == -1 || (up && cx - w < x))
+                break;
+            col -= cnt;
+            cx -= w;
+        }
+    } else {
+        size_t len = __prompt_len(p);
+        s = __prompt_after(p) - col; // indexed by byte offset in the line
+        while (col < len && cx < x) {
+            if ((cnt = utf8_next(s + col, len - col, &w)) == -1 || (!up && cx + w > x))
+                break;
+            col += cnt;
+            cx += w;
+        }
+    }
+    *out_x = cx;
+    return col;
+}
+
+/**
+ * appends the part of the current line that fits in `avail` cells to the next frame,
+ * with an ellipsis on the sides where it's cut. the window only moves once the cursor leaves it.
+ * returns the cell of the cursor within the window, or -1 on error.
+ */
+static ssize_t __render_window(struct prompt *p, size_t avail)
+{
+    struct prompt_screen *scr = &p->prmt_screen;
+    size_t len = __prompt_cols(p), c = p->prmt_cur_x, off = scr->hscroll_off;
+
+    // the cursor may sit right after the last character, so the line takes `len + 1` cells
+    if (off > c || c - off < (off ? 1 : 0) || c - off > avail - 1 - (len + 1 - off > avail))
+        off = (c > avail / 2 ? c - avail / 2 : 0); // center the cursor
+    scr->hscroll_off = off;
+
+    size_t first = off + (off ? 1 : 0);
+    int cut = (len + 1 - off > avail);
+    size_t last = off + avail - cut;
+    if (last > len)
+        last = len;
+
+    // wide characters cut by the edges are left out, and spaces take their place
+    size_t from_x, to_x;
+    size_t from = __prompt_byte_of(p, first, 1, &from_x), to = __prompt_byte_of(p, last, 0, &to_x);
+    size_t col = p->prmt_cur_col;
+    if ((off && __render_append(scr, PRMT_ELLIPSIS, strlen(PRMT_ELLIPSIS))) ||
+        (from_x > first && __render_append(scr, " ", 1)) ||
+        (from < col && __render_append(scr, __prompt_before(p) + from, col - from)) ||
+        (to > col && __render_append(scr, __prompt_after(p), to - col)) ||
+        (to_x < last && __render_append(scr, " ", 1)) ||
+        (cut && __render_append(scr, PRMT_ELLIPSIS, strlen(PRMT_ELLIPSIS))))
+        return -1;
+    return c - off;
+}
+
+/**
+ * returns the width the prompt is laid out with, unknown widths never wrap.
+ */
+static size_t __render_width(const struct prompt_screen *scr)
+{
+    return (scr->width ?: (SIZE_MAX >> 1));
+}
+
+/**
+ * returns whether the current line, laid out after ps1 or the search bar (ending on cell `head_end`),
+ * needs more rows than the screen has.
+ */
+static int __render_tall(struct prompt *p, size_t head_end, int padded)
+{
+    struct prompt_screen *scr = &p->prmt_screen;
+    size_t end;
+
+    if (!scr->width || !scr->height)
+        return 0;
+    if (!padded)
+        end = head_end + __prompt_cols(p);
+    else {
+        end = __render_layout(__prompt_before(p), p->prmt_cur_col, head_end, scr->width);
+        end = __render_layout(__prompt_after(p), __prompt_len(p) - p->prmt_cur_col, end, scr->width);
+    }
+    return (end / scr->width + 1 > scr->height);
+}
+
+/**
+ * brings the prompt on screen up to date with `p`, emitting only what changed.
+ * the unchanged head is skipped, and if the change and the unchanged tail share the last row,
+ * the middle is replaced by inserting or deleting characters instead of reprinting everything after it.
+ * returns 0 on success and -1 on error.
+ */
+static int __prompt_render(struct prompt *p)
+{
+    struct prompt_screen *scr = &p->prmt_screen;
+    struct prompt_line *l = &p->prmt_line[p->prmt_cur_row];
+    size_t width = __render_width(scr);
+    size_t target, ps1_len = strlen(p->prmt_ps1), ps1_end = __render_layout(p->prmt_ps1, ps1_len, 0, width);
+
+    // the search bar takes the place of ps1, its result is the current line
+    const char *head = (p->prmt_srch_line ?: p->prmt_ps1);
+    size_t head_len = (p->prmt_srch_line ? PRMT_SRCH_TLEN + p->prmt_srch_query_sz : ps1_len);
+    size_t head_end = (p->prmt_srch_line ? __render_layout(head, head_len, 0, width) : ps1_end);
+
+    // wide characters may leave the last column of a row empty, then the line has to be laid out
+    int padded = (scr->width && __prompt_wide(p));
+
+    // horizontal scroll keeps the line on the last row of the head, leaving the last column alone so it never wraps.
+    // a line taller than the screen scrolls horizontally too, even in search: its first rows would scroll
+    // out of reach of the cursor. a head leaving too little of its last row has the line start on the next one
+    size_t avail = (scr->width ? width - head_end % width - 1 : 0);
+    int hscroll = (scr->width && ((scr->hscroll && !p->prmt_srch_line) || __render_tall(p, head_end, padded)));
+    int brk = (hscroll && avail < 4 && width - 1 >= 4);
+    if (brk) {
+        head_end = (head_end / width + 1) * width;
+        avail = width - 1;
+    }
+    hscroll = (hscroll && avail >= 4);
+    ssize_t window;
+
+    if (p->prmt_srch_line)
+        target = __render_layout(p->prmt_srch_line, PRMT_SRCH_TLEN + p->prmt_srch_query_sz + p->prmt_cur_col, 0, width);
+    else if (padded && !hscroll)
+        target = __render_layout(__prompt_before(p), p->prmt_cur_col, ps1_end, width);
+    else
+        target = ps1_end + p->prmt_cur_x;
+
+    // a cursor move may scroll the window
+    if (hscroll)
+        scr->dirty = 1;
+
+    if (!scr->dirty) {
+        __render_move(scr->cur, target, width);
+        scr->cur = target;
+        return 0;
+    }
+
+    // build the prompt as it should look
+    scr->next_len = 0;
+    if (hscroll) {
+        if (__render_append(scr, head, head_len) || (brk && __render_append(scr, "\n", 1)) ||
+            -1 == (window = __render_window(p, avail)))
+            return -1;
+        target = head_end + window;
+    } else if (p->prmt_srch_line) {
+        if (__render_append(scr, p->prmt_srch_line, p->prmt_srch_line_sz))
+            return -1;
+    } else {
+        if (__render_append(scr, p->prmt_ps1, ps1_len))
+            return -1;
+
+        // both sides of the gap, without closing it
+        if (l->buf) {
+            if (__render_append(scr, l->buf, l->gap) || __render_append(scr, l->buf + l->gap_end, l->cap - l->gap_end))
+                return -1;
+        } else if (prompt_get(p)) {
+            if (__render_append(scr, prompt_get(p), p->prmt_row_len))
+                return -1;
+        }
+    }
+
+    const char *old = scr->text, *next = scr->next;
+    size_t olen = scr->len, nlen = scr->next_len;
+    size_t min = (olen < nlen ? olen : nlen);
+    size_t pre = 0, suf = 0;
+
+    // unchanged head and tail, both ending on character boundaries.
+    // combining marks go with the character before them, so they're never written on their own
+    pre = __render_prefix(old, next, min);
+    while (pre && ((pre < olen && (old[pre] & 0xc0) == 0x80) || (pre < nlen && (next[pre] & 0xc0) == 0x80) ||
+                   (pre < olen && (unsigned char)old[pre] >= 0x80 && !utf8_chwidth(old + pre, olen - pre)) ||
+                   (pre < nlen && (unsigned char)next[pre] >= 0x80 && !utf8_chwidth(next + pre, nlen - pre))))
+        pre--;
+    suf = __render_suffix(old, olen, next, nlen, min - pre);
+    while (suf && ((next[nlen - suf] & 0xc0) == 0x80 ||
+                   ((unsigned char)next[nlen - suf] >= 0x80 && !utf8_chwidth(next + nlen - suf, suf))))
+        suf--;
+
+    if (pre != olen || pre != nlen) {
+        size_t omid = utf8_width(old + pre, olen - suf - pre);
+        size_t nmid = utf8_width(next + pre, nlen - suf - pre);
+        size_t cell, end;
+
+        // there are no line breaks after ps1, so the line is laid out without looking at it
+        int line = (hscroll ? pre >= head_len + brk : !p->prmt_srch_line && pre >= ps1_len);
+        if (line && hscroll)
+            cell = head_end + utf8_width(next + head_len + brk, pre - head_len - brk);
+        else if (line && !padded)
+            cell = ps1_end + __prompt_col_of(p, pre - ps1_len); // indexed, long lines aren't recounted
+        else if (line)
+            cell = __render_layout(next + ps1_len, pre - ps1_len, ps1_end, width);
+        else
+            cell = __render_layout(next, pre, 0, width);
+
+        __render_move(scr->cur, cell, width);
+
+        // shifting costs the middle and an escape sequence, reprinting costs everything after the head.
+        // shifting only works within a row: the change and the end of the text before and after it must share it.
+        end = scr->end + nmid - omid;
+        if (padded && cell / width == scr->end / width)
+            end = __render_layout(next + pre, nlen - pre, cell, width); // the tail may wrap differently
+        int shift = (line && suf && cell / width == scr->end / width && cell / width == end / width && end % width);
+        size_t shift_cost = (nlen - suf - pre) + (omid != nmid ? 6 : 0);
+        size_t reprint_cost = (nlen - pre) + (olen - suf - pre > nlen - suf - pre ? 3 : 0);
+
+        if (shift && shift_cost < reprint_cost) {
+            if (nmid > omid)
+                prompt_frame_printf(VT_CHRINS_N, (int)(nmid - omid));
+            prompt_frame_write(next + pre, nlen - suf - pre);
+            if (nmid < omid)
+                prompt_frame_printf(VT_CHRDEL_N, (int)(omid - nmid));
+            scr->cur = cell + nmid;
+        } else {
+            // the last column left empty before a wide character keeps whatever was there
+            if (padded)
+                prompt_frame_puts(VT_SCREOS);
+            prompt_frame_write(next + pre, nlen - pre);
+            end = __render_layout(next + pre, nlen - pre, cell, width);
+
+            // text that ends on the last column leaves the cursor there until the next character,
+            // take it to the next row so cursor math holds. a line break already did
+            if (end % width == 0 && end != cell && next[nlen - 1] != '\n')
+                prompt_frame_puts("\r\n");
+
+            // clear what's left of the old text, possibly on rows below
+            if (scr->end / width > end / width)
+                prompt_frame_puts(VT_SCREOS);
+            else if (scr->end > end)
+                prompt_frame_puts(VT_CUREOL);
+            scr->cur = end;
+        }
+        scr->end = end;
+    }
+
+    __render_move(scr->cur, target, width);
+    scr->cur = target;
+
+    // what was rendered is now on screen
+    char *text = scr->text;
+    size_t cap = scr->cap;
+    scr->text = scr->next;
+    scr->len = scr->next_len;
+    scr->cap = scr->next_cap;
+    scr->next = text;
+    scr->next_cap = cap;
+    scr->next_len = 0;
+    scr->dirty = 0;
+    return 0;
+}
+
+/**
+ * takes a new terminal size and redraws the prompt with it.
+ * the cursor goes back to the first row of the prompt (as laid out with the old width) and everything
+ * below is cleared, terminals don't agree on how they rewrap what's already there.
+ */
+static void __prompt_resize(struct prompt *p, size_t width, size_t height)
+{
+    struct prompt_screen *scr = &p->prmt_screen;
+
+    prompt_frame_sync();
+    __render_move(scr->cur, 0, __render_width(scr));
+    prompt_frame_puts(VT_SCREOS);
+    scr->len = scr->cur = scr->end = 0;
+    scr->width = width;
+    scr->height = height;
+    scr->dirty = 1;
+}
+
+/**
+ * returns the width of the terminal on `fd`, and its height via `out_rows`, both 0 if unknown.
+ */
+static size_t __prompt_term_size(int fd, size_t *out_rows)
+{
+    struct winsize winsz;
+    *out_rows = 0;
+    if (ioctl(fd, TIOCGWINSZ, &winsz) == -1)
+        return 0;
+    *out_rows = winsz.ws_row;
+    return winsz.ws_col;
+}
+
+/**
+ * returns 0 on success and non-zero on failure.
+ */
+static int __prompt_output_search(struct prompt *p, const char *s, size_t n)
+{
+    int moves = utf8_strnlen(s, n);
+    if (moves == -1)
+        return -1;
+    
+    // do nothing for empty string
+    if (!moves)
+        return -1;
+    
+    if (!(p->prmt_srch_line = realloc(p->prmt_srch_line, p->prmt_srch_line_sz + n + 1))) // 1 for \0
+        return -1;
+
+    // make room for new data in query
+    //  s = "text", n = 4
+    //  before: (reverse-search)`my': mydataisnice 
+    //  after:  (reverse-search)`my@@@@': mydataisnice 
+
+    memmove(p->prmt_srch_line + PRMT_SRCH_QSTART + p->prmt_srch_query_sz + n,
+            p->prmt_srch_line + PRMT_SRCH_QSTART + p->prmt_srch_query_sz,
+            p->prmt_srch_line_sz - (PRMT_SRCH_QSTART + p->prmt_srch_query_sz));
+
+    // copy new data
+    memcpy(p->prmt_srch_line + PRMT_SRCH_QSTART + p->prmt_srch_query_sz,
+           s,
+           n);
+    
+    // put null terminator and update line and query sizes (in bytes)
+    p->prmt_srch_line[p->prmt_srch_line_sz + n] = 0;
+    p->prmt_srch_line_sz += n;
+    p->prmt_srch_query_sz += n;
+    p->prmt_screen.dirty = 1;
+
+    if (0 != __prompt_search(p, 0, p->prmt_srch_line + PRMT_SRCH_QSTART, p->prmt_srch_query_sz))
+        return -1; // general failure while searching
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_line(struct prompt *p, const char *s, size_t n)
+{
+    int moves = utf8_strnlen(s, n);
+    if (moves == -1)
+        return -1;
+    
+    // do nothing for empty string
+    if (!moves)
+        return -1;
+    
+    struct prompt_line *curr_line = __prompt_edit(p);
+    size_t cols = (curr_line ? curr_line->cols : 0);
+    if (!curr_line || prompt_line_insert(curr_line, p->prmt_cur_col, s, n))
+        return -1;
+    __prompt_edited(p, p->prmt_cur_col);
+    p->prmt_cur_col += n;
+    p->prmt_cur_x += curr_line->cols - cols;
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_enter_search(struct prompt *p)
+{
+    if (p->prmt_srch_line)
+        return 0; // already in search, ignore
+    
+    const char *curr_line = __prompt_get(p, p->prmt_cur_row);
+    size_t curr_line_sz = (curr_line ? strlen(curr_line) : 0);
+
+    // initialize search line with searchbar and current line, put null terminator at the end
+    if (!(p->prmt_srch_line = malloc(PRMT_SRCH_TLEN + curr_line_sz + 1))) // +1 for \0
+        return -1;
+    memcpy(p->prmt_srch_line, PRMT_SRCH_TEXT, PRMT_SRCH_TLEN);
+    memcpy(p->prmt_srch_line + PRMT_SRCH_TLEN, curr_line, curr_line_sz);
+    p->prmt_srch_line[PRMT_SRCH_TLEN + curr_line_sz] = 0;
+    p->prmt_srch_line_sz = PRMT_SRCH_TLEN + curr_line_sz;
+    p->prmt_srch_query_sz = 0;
+    p->prmt_screen.dirty = 1;
+    prompt_frame_sync();
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_next_search(struct prompt *p)
+{
+    if (!p->prmt_srch_line)
+        return -1; // not in search mode
+
+    if (0 != __prompt_search(p, p->prmt_cur_row + 1, p->prmt_srch_line + PRMT_SRCH_QSTART, p->prmt_srch_query_sz))
+        return -1; // general failure while searching
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_exit_search(struct prompt *p)
+{
+    if (!p->prmt_srch_line)
+        return 0; // not in search, ignore
+
+    // reset search params
+    free(p->prmt_srch_line);
+    p->prmt_srch_line = NULL;
+    p->prmt_srch_line_sz = p->prmt_srch_query_sz = 0;
+    p->prmt_screen.dirty = 1;
+    prompt_frame_sync();
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_backspace_search(struct prompt *p)
+{
+    if (!p->prmt_srch_line)
+        return -1; // not in search
+    
+    if (!p->prmt_srch_query_sz)
+        return 0; // no search, ignore
+
+    int del = utf8_rsize((unsigned char *)(p->prmt_srch_line + PRMT_SRCH_QSTART), p->prmt_srch_query_sz);
+    if (!del)
+        return -1; // invalid utf8 length
+    
+    memmove(p->prmt_srch_line + PRMT_SRCH_QSTART + p->prmt_srch_query_sz - del,
+            p->prmt_srch_line + PRMT_SRCH_QSTART + p->prmt_srch_query_sz,
+            p->prmt_srch_line_sz - (PRMT_SRCH_QSTART + p->prmt_srch_query_sz) + 1); // +1 for \0
+    p->prmt_srch_line_sz -= del;
+    p->prmt_srch_query_sz -= del;
+    p->prmt_screen.dirty = 1;
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_backspace_line(struct prompt *p)
+{
+    size_t width;
+    ssize_t del;
+
+    if (!p->prmt_cur_col)
+        return 0; // nothing to delete
+    
+    struct prompt_line *curr_line = __prompt_edit(p);
+    if (!curr_line)
+        return -1;
+
+    if (-1 == (del = utf8_prev(__prompt_before(p), p->prmt_cur_col, &width)))
+        return -1;
+    
+    p->prmt_cur_col -= del;
+    p->prmt_cur_x -= width;
+    prompt_line_delete(curr_line, p->prmt_cur_col, del);
+    __prompt_edited(p, p->prmt_cur_col);
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_del(struct prompt *p)
+{
+    size_t width;
+    ssize_t del;
+
+    if (p->prmt_cur_col >= __prompt_len(p))
+        return 0; // nothing to delete
+    
+    struct prompt_line *curr_line = __prompt_edit(p);
+    if (!curr_line)
+        return -1;
+
+    if (-1 == (del = utf8_next(__prompt_after(p), __prompt_len(p) - p->prmt_cur_col, &width)))
+        return -1;
+    
+    prompt_line_delete(curr_line, p->prmt_cur_col, del);
+    __prompt_edited(p, p->prmt_cur_col);
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_cursor_backward(struct prompt *p)
+{
+    size_t width;
+    ssize_t cnt;
+
+    if (!p->prmt_cur_col)
+        return 0; // nothing to delete
+    
+    if (-1 == (cnt = utf8_prev(__prompt_before(p), p->prmt_cur_col, &width)))
+        return -1;
+    
+    p->prmt_cur_col -= cnt;
+    p->prmt_cur_x -= width;
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_cursor_forward(struct prompt *p)
+{
+    size_t width;
+    ssize_t cnt;
+
+    if (p->prmt_cur_col >= __prompt_len(p))
+        return 0; // nothing to delete
+    
+    if (-1 == (cnt = utf8_next(__prompt_after(p), __prompt_len(p) - p->prmt_cur_col, &width)))
+        return -1;
+
+    p->prmt_cur_col += cnt;
+    p->prmt_cur_x += width;
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_cursor_home(struct prompt *p)
+{
+    p->prmt_cur_col = 0;
+    p->prmt_cur_x = 0;
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_cursor_end(struct prompt *p)
+{
+    p->prmt_cur_col = __prompt_len(p);
+    p->prmt_cur_x = __prompt_cols(p);
+    return 0;
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_history_up(struct prompt *p)
+{
+    if (p->prmt_cur_row + 1 >= HIST_MAX + 1) // out-of-bounds
+        return 0;
+    
+    if (!history_get(p->prmt_cur_row)) // top of history (no +1, history is HIST_MAX, prmt_lines is 1+HIST_MAX)
+        return 0;
+
+    // exit search if in search
+    if (__prompt_output_exit_search(p))
+        return -1;
+
+    prompt_frame_sync();
+    __prompt_set_row(p, p->prmt_cur_row + 1, 0);
+    return __prompt_output_cursor_end(p);
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ */
+static int __prompt_output_history_down(struct prompt *p)
+{
+    if (!p->prmt_cur_row)
+        return 0;
+
+    // exit search if in search
+    if (__prompt_output_exit_search(p))
+        return -1;
+
+    prompt_frame_sync();
+    __prompt_set_row(p, p->prmt_cur_row - 1, 0);
+    return __prompt_output_cursor_end(p);
+}
+
+/**
+ * returns 0 on success and non-zero on failure
+ * NOTE: prints to screen, the prompt is redrawn from scratch on top of it.
+ */
+static int __prompt_output_clear(struct prompt *p)
+{
+    // exit search if in search
+    if (__prompt_output_exit_search(p))
+        return -1;
+
+    prompt_frame_sync();
+    prompt_frame_printf(VT_CURSET_R_C VT_SCRCLR, 1, 1);
+    p->prmt_screen.len = p->prmt_screen.cur = p->prmt_screen.end = 0;
+    p->prmt_screen.dirty = 1;
+    p->prmt_screen.home = 1;
+    return 0;
+}
+
+/**
+ * appends byte `c` of a bracketed paste, holding back bytes that may start the end marker.
+ * returns 1 once the end marker was seen, 0 if more is needed and -1 on error.
+ */
+static int __prompt_paste_feed(struct prompt_paste *paste, char c)
+{
+    if (c == PRMT_PASTE_END[paste->match]) {
+        if (!PRMT_PASTE_END[++paste->match])
+            return 1;
+        return 0;
+    }
+
+    // mismatch - the held back bytes were text after all (the marker has no repeating prefix)
+    size_t held = paste->match;
+    paste->match = 0;
+    if (paste->len + held + 2 > paste->cap) {
+        size_t cap = (paste->cap ? paste->cap * 2 : 256);
+        while (paste->len + held + 2 > cap)
+            cap *= 2;
+        char *buf = realloc(paste->buf, cap);
+        if (!buf)
+            return -1;
+        paste->buf = buf;
+        paste->cap = cap;
+    }
+    memcpy(paste->buf + paste->len, PRMT_PASTE_END, held);
+    paste->len += held;
+
+    if (c == PRMT_PASTE_END[0]) {
+        paste->match = 1;
+        return 0;
+    }
+    paste->buf[paste->len++] = c;
+    return 0;
+}
+
+/**
+ * inserts the collected paste with a single edit and redraw.
+ * line breaks and tabs become spaces, other control chars and invalid utf8 are dropped.
+ * returns 0 on success and -1 on error.
+ */
+static int __prompt_output_paste(struct prompt *p)
+{
+    struct prompt_paste *paste = &p->prmt_paste;
+    size_t i = 0, n = 0;
+
+    paste->active = 0;
+    while (i < paste->len) {
+        unsigned char c = paste->buf[i];
+        if (c == '\r' && i + 1 < paste->len && paste->buf[i + 1] == '\n') {
+            i++; // \r\n is a single line break
+            continue;
+        }
+        if (c == '\n' || c == '\r' || c == '\t') {
+            paste->buf[n++] = ' ';
+            i++;
+            continue;
+        }
+        if (c < 0x20 || c == 0x7f) {
+            i++;
+            continue;
+        }
+
+        int u8sz = utf8_size(c);
+        if (u8sz < 1 || (size_t)u8sz > paste->len - i || utf8_strnlen(paste->buf + i, u8sz) != 1) {
+            i++;
+            continue;
+        }
+        memmove(paste->buf + n, paste->buf + i, u8sz);
+        n += u8sz;
+        i += u8sz;
+    }
+    paste->len = 0;
+
+    if (!n)
+        return 0;
+    return (p->prmt_srch_line ? __prompt_output_search : __prompt_output_line)(p, paste->buf, n);
+}
+
+/////////////
+// Keymap
+/////////////
+
+/**
+ * editing functions keys are bound to, by name.
+ * each returns like __prompt_output: NULL to keep reading, or the line, PRMT_EXIT or PRMT_ABRT.
+ */
+struct prompt_fn {
+    const char *name;
+    const char *(*fn)(struct prompt *p);
+};
+
+/**
+ * shows the line as it is (it may not be rendered yet) and leaves the cursor after it.
+ * returns 0 on success and -1 on error.
+ */
+static int __prompt_leave(struct prompt *p)
+{
+    if (__prompt_render(p))
+        return -1;
+    __render_move(p->prmt_screen.cur, p->prmt_screen.end, __render_width(&p->prmt_screen));
+    p->prmt_screen.cur = p->prmt_screen.end;
+    return 0;
+}
+
+static const char *__prompt_fn_accept_line(struct prompt *p)
+{
+    if (__prompt_leave(p))
+        return PRMT_ABRT;
+    prompt_frame_puts("\n");
+    return (prompt_get(p) ?: ""); // can't return null because we want to reprint ps1
+}
+
+static const char *__prompt_fn_abort_line(struct prompt *p)
+{
+    if (__prompt_leave(p))
+        return PRMT_ABRT;
+    ECHO_CNTRL(CTRL_C);
+    prompt_frame_puts("\n");
+    return "";
+}
+
+static const char *__prompt_fn_end_of_file(struct prompt *p)
+{
+    if (__prompt_leave(p))
+        return PRMT_ABRT;
+    ECHO_CNTRL(CTRL_D);
+    prompt_frame_puts("\n");
+    return PRMT_EXIT;
+}
+
+static const char *__prompt_fn_search(struct prompt *p)
+{
+    int ret = (p->prmt_srch_line ? __prompt_output_next_search : __prompt_output_enter_search)(p);
+    return ret ? PRMT_ABRT : NULL;
+}
+
+static const char *__prompt_fn_exit_search(struct prompt *p)
+{
+    return __prompt_output_exit_search(p) ? PRMT_ABRT : NULL;
+}
+
+static const char *__prompt_fn_backspace(struct prompt *p)
+{
+    int ret = (p->prmt_srch_line ? __prompt_output_backspace_search : __prompt_output_backspace_line)(p);
+    return ret ? PRMT_ABRT : NULL;
+}
+
+static const char *__prompt_fn_history_up(struct prompt *p)
+{
+    return __prompt_output_history_up(p) ? PRMT_ABRT : NULL;
+}
+
+static const char *__prompt_fn_history_down(struct prompt *p)
+{
+    return __prompt_output_history_down(p) ? PRMT_ABRT : NULL;
+}
+
+static const char *__prompt_fn_clear(struct prompt *p)
+{
+    return __prompt_output_clear(p) ? PRMT_ABRT : NULL;
+}
+
+// the rest only work in line mode, search is left first
+#define PRMT_FN_LINE(Name, Fn) \
+    static const char *__prompt_fn_##Name(struct prompt *p) \
+    { \
+        return (__prompt_output_exit_search(p) || Fn(p)) ? PRMT_ABRT : NULL; \
+    }
+
+PRMT_FN_LINE(del, __prompt_output_del)
+PRMT_FN_LINE(backward, __prompt_output_cursor_backward)
+PRMT_FN_LINE(forward, __prompt_output_cursor_forward)
+PRMT_FN_LINE(home, __prompt_output_cursor_home)
+PRMT_FN_LINE(end, __prompt_output_cursor_end)
+
+// index 0 is no function
+static const struct prompt_fn prompt_fns[] = {
+    {NULL, NULL},
+    {"accept-line", __prompt_fn_accept_line},
+    {"abort-line", __prompt_fn_abort_line},
+    {"end-of-file", __prompt_fn_end_of_file},
+    {"clear-screen", __prompt_fn_clear},
+    {"reverse-search-history", __prompt_fn_search},
+    {"exit-search", __prompt_fn_exit_search},
+    {"backward-delete-char", __prompt_fn_backspace},
+    {"delete-char", __prompt_fn_del},
+    {"backward-char", __prompt_fn_backward},
+    {"forward-char", __prompt_fn_forward},
+    {"beginning-of-line", __prompt_fn_home},
+    {"end-of-line", __prompt_fn_end},
+    {"previous-history", __prompt_fn_history_up},
+    {"next-history", __prompt_fn_history_down},
+};
+
+#define PRMT_FN_CNT (sizeof(prompt_fns) / sizeof(*prompt_fns))
+
+/**
+ * returns the index of function `name` in prompt_fns, or 0 if there's none.
+ */
+static size_t prompt_fn_find(const char *name)
+{
+    for (size_t i = 1; i < PRMT_FN_CNT; i++)
+        if (!strcmp(prompt_fns[i].name, name))
+            return i;
+    return 0;
+}
+
+/**
+ * keys are codes: characters are their code point, control keys are TCHCTRL_* above unicode,
+ * and modifiers (TCHMOD_*) are the top byte.
+ */
+#define PRMT_KEY_CTRL 0x200000
+
+static uint32_t __prompt_key(const struct __termchar *termchar)
+{
+    uint32_t key;
+    if (termchar->tch_type == TCHTYPE_CTRL)
+        key = PRMT_KEY_CTRL | termchar->tch_ctrl.value;
+    else
+        utf8_decode(termchar->tch_text.data, termchar->tch_text.sz, &key);
+    return key | ((uint32_t)termchar->tch_mods << 24);
+}
+
+/**
+ * the keymap is a trie of key sequences, stored as a hash table of its edges:
+ * (node, key) leads to a function, or to another node if the key starts a longer sequence.
+ * a lookup is a hash probe per key, however many bindings there are.
+ */
+struct prompt_keymap_ent {
+    uint32_t node;  // trie node the key is pressed in, 0 is the root
+    uint32_t key;   // key code, 0 marks a free slot
+    uint32_t child; // node the key leads to, 0 if it ends the sequence
+    uint32_t fn;    // index in prompt_fns, 0 if unbound
+    char    *seq;   // the sequence as it was bound, for listing
+};
+
+struct prompt_keymap {
+    struct prompt_keymap_ent *ent;
+    size_t cap; // power of 2
+    size_t n;
+    uint32_t nodes;
+};
+
+static struct prompt_keymap prompt_keymap;
+
+#define PRMT_KEYMAP_MIN 64
+
+static size_t __prompt_keymap_slot(const struct prompt_keymap *km, uint32_t node, uint32_t key)
+{
+    uint64_t h = (((uint64_t)node << 32) | key) * 0x9e3779b97f4a7c15ull;
+    size_t i = (h >> 32) & (km->cap - 1);
+    while (km->ent[i].key && (km->ent[i].node != node || km->ent[i].key != key))
+        i = (i + 1) & (km->cap - 1);
+    return i;
+}
+
+/**
+ * returns the edge of `key` in `node`, or NULL if there's none.
+ */
+static struct prompt_keymap_ent *prompt_keymap_find(uint32_t node, uint32_t key)
+{
+    struct prompt_keymap *km = &prompt_keymap;
+    if (!km->cap)
+        return NULL;
+    struct prompt_keymap_ent *ent = &km->ent[__prompt_keymap_slot(km, node, key)];
+    return (ent->key ? ent : NULL);
+}
+
+/**
+ * returns the edge of `key` in `node`, added if there's none, or NULL on error.
+ */
+static struct prompt_keymap_ent *__prompt_keymap_add(uint32_t node, uint32_t key)
+{
+    struct prompt_keymap *km = &prompt_keymap;
+
+    // at most half full, so probes stay short
+    if ((km->n + 1) * 2 > km->cap) {
+        struct prompt_keymap grown = { .cap = (km->cap ? km->cap * 2 : PRMT_KEYMAP_MIN), .n = km->n, .nodes = km->nodes };
+        if (!(grown.ent = calloc(grown.cap, sizeof(*grown.ent))))
+            return NULL;
+        for (size_t i = 0; i < km->cap; i++)
+            if (km->ent[i].key)
+                grown.ent[__prompt_keymap_slot(&grown, km->ent[i].node, km->ent[i].key)] = km->ent[i];
+        free(km->ent);
+        *km = grown;
+    }
+
+    struct prompt_keymap_ent *ent = &km->ent[__prompt_keymap_slot(km, node, key)];
+    if (!ent->key) {
+        ent->node = node;
+        ent->key = key;
+        km->n++;
+    }
+    return ent;
+}
+
+#define PRMT_KEYSEQ_MAX 16
+
+/**
+ * decodes key sequence `seq` into at most PRMT_KEYSEQ_MAX key codes at `keys`.
+ * it's written the way a terminal sends it, with readline's escapes: "\e" or "\E" for escape,
+ * "\C-x" for control, "\M-x" for alt, and "\\", "\t", "\n" and "\'" or "\"" for themselves.
+ * returns the amount of keys, or -1 if it isn't a valid sequence.
+ */
+static ssize_t prompt_keyseq(const char *seq, uint32_t *keys)
+{
+    struct __termchar termchar;
+    unsigned char bytes[4];
+    size_t n = 0, nbytes;
+    int ret;
+
+    memset(&termchar, 0, sizeof(termchar));
+    while (*seq) {
+        nbytes = 1;
+        if (seq[0] != '\\' || !seq[1]) {
+            bytes[0] = *seq++;
+        } else if ((!strncmp(seq, "\\C-", 3) || !strncmp(seq, "\\M-", 3)) && !seq[3]) {
+            return -1; // a modifier with no key
+        } else if (!strncmp(seq, "\\C-", 3)) {
+            bytes[0] = (seq[3] == '?' ? BACKSPACE : (seq[3] & 0x1f));
+            seq += 4;
+        } else if (!strncmp(seq, "\\M-", 3)) {
+            bytes[0] = '\e';
+            bytes[1] = seq[3];
+            nbytes = 2;
+            seq += 4;
+        } else {
+            char c = seq[1];
+            bytes[0] = (c == 'e' || c == 'E' ? '\e' : c == 't' ? '\t' : c == 'n' ? '\n' : c);
+            seq += 2;
+        }
+
+        // decoded like a terminal sending it at once
+        for (size_t i = 0; i < nbytes; i++) {
+            if ((ret = __termchar_input(&termchar, bytes[i])) == -1)
+                return -1;
+            if (ret == 0)
+                continue;
+            if (n == PRMT_KEYSEQ_MAX)
+                return -1;
+            keys[n++] = __prompt_key(&termchar);
+            memset(&termchar, 0, sizeof(termchar));
+        }
+    }
+
+    // a sequence cut short ends like it does when typed
+    if (__termchar_escape(&termchar)) {
+        if (__termchar_timeout(&termchar) == -1 || n == PRMT_KEYSEQ_MAX)
+            return -1;
+        keys[n++] = __prompt_key(&termchar);
+    } else if (termchar.tch_state != TCHSTATE_GROUND) {
+        return -1;
+    }
+    return n;
+}
+
+/**
+ * binds key sequence `seq` to function `fn` (an index in prompt_fns, 0 unbinds it).
+ * a key that starts a longer sequence waits for the rest, so the shorter binding is shadowed.
+ * text typed at the prompt is inserted without looking it up, so it can't start a sequence.
+ * returns 0 on success, -1 on error, -2 if `seq` isn't a valid key sequence
+ * and -3 if it starts with a text key.
+ */
+static int prompt_keymap_bind(const char *seq, size_t fn)
+{
+    uint32_t keys[PRMT_KEYSEQ_MAX];
+    struct prompt_keymap_ent *ent;
+    uint32_t node = 0;
+    ssize_t n;
+    char *dup;
+
+    if ((n = prompt_keyseq(seq, keys)) < 1)
+        return -2;
+    if (keys[0] < PRMT_KEY_CTRL)
+        return -3;
+
+    for (ssize_t i = 0; i < n - 1; i++) {
+        if (!(ent = __prompt_keymap_add(node, keys[i])))
+            return -1;
+        if (!ent->child)
+            ent->child = ++prompt_keymap.nodes;
+        node = ent->child;
+    }
+
+    if (!(dup = strdup(seq)) || !(ent = __prompt_keymap_add(node, keys[n - 1]))) {
+        free(dup);
+        return -1;
+    }
+    free(ent->seq);
+    ent->seq = dup;
+    ent->fn = fn;
+    return 0;
+}
+
+static const struct {
+    const char *seq;
+    const char *fn;
+} prompt_default_keys[] = {
+    {"\\n",    "accept-line"},
+    {"\\C-c",  "abort-line"},
+    {"\\C-d",  "end-of-file"},
+    {"\\C-l",  "clear-screen"},
+    {"\\C-r",  "reverse-search-history"},
+    {"\\t",    "exit-search"},
+    {"\\C-?",  "backward-delete-char"},
+    {"\\e[3~", "delete-char"},
+    {"\\C-b",  "backward-char"},
+    {"\\e[D",  "backward-char"},
+    {"\\C-f",  "forward-char"},
+    {"\\e[C",  "forward-char"},
+    {"\\C-a",  "beginning-of-line"},
+    {"\\e[H",  "beginning-of-line"},
+    {"\\C-e",  "end-of-line"},
+    {"\\e[F",  "end-of-line"},
+    {"\\e[A",  "previous-history"},
+    {"\\e[B",  "next-history"},
+};
+
+/**
+ * binds the default keys, once.
+ * returns 0 on success and -1 on error.
+ */
+static int prompt_keymap_init(void)
+{
+    if (prompt_keymap.cap)
+        return 0;
+    for (size_t i = 0; i < sizeof(prompt_default_keys) / sizeof(*prompt_default_keys); i++)
+        if (prompt_keymap_bind(prompt_default_keys[i].seq, prompt_fn_find(prompt_default_keys[i].fn)))
+            return -1;
+    return 0;
+}
+
+/**
+ * takes what the terminal answered to a query.
+ */
+static void __prompt_report(const struct __termchar *input)
+{
+    const uint16_t *param = input->tch_ctrl.private.param;
+    uint8_t count = input->tch_ctrl.private.count;
+
+    uint8_t final = input->tch_ctrl.private.final, priv = input->tch_ctrl.private.priv;
+
+    // DECRPM, the mode is known if set (1), reset (2) or permanently set (3)
+    if (final == 'y' && priv == '?' && input->tch_ctrl.private.inter == '$' && count >= 2) {
+        if (param[0] == 2004)
+            prompt_term.paste = (param[1] >= 1 && param[1] <= 3);
+        else if (param[0] == 2026)
+            prompt_term.sync = (param[1] >= 1 && param[1] <= 3);
+    }
+    // DA2, a cache learnt from another terminal with the same $TERM is dropped and the features asked for
+    else if (final == 'c' && priv == '>' && count >= 2) {
+        if (prompt_term.known && (prompt_term.da2_type != param[0] || prompt_term.da2_version != param[1])) {
+            prompt_term.known = 0;
+            prompt_term.paste = -1;
+            prompt_term.sync = 0;
+            prompt_frame_puts(VT_PASTE_QUERY VT_SYNC_QUERY VT_DA_QUERY);
+        }
+        prompt_term.da2_type = param[0];
+        prompt_term.da2_version = param[1];
+    }
+    // DA1 was asked last, everything that was going to be answered was
+    else if (final == 'c' && priv == '?' && prompt_term.queried && !prompt_term.known) {
+        prompt_term.known = 1;
+        prompt_term_save();
+    }
+}
+
+static const char *__prompt_output(struct prompt *p, struct __termchar *input)
+{
+    int ret;
+    if (input->tch_type == TCHTYPE_TEXT && !input->tch_mods && !p->prmt_keynode) {
+        ret = (p->prmt_srch_line ? __prompt_output_search : __prompt_output_line)(p, input->tch_text.data, input->tch_text.sz);
+        return ret ? PRMT_ABRT : NULL;
+    }
+
+    if (input->tch_type != TCHTYPE_CTRL && input->tch_type != TCHTYPE_TEXT)
+        return PRMT_ABRT;
+
+    // the terminal marks pastes, it's not a key
+    if (input->tch_type == TCHTYPE_CTRL && input->tch_ctrl.value == TCHCTRL_PASTE_START) {
+        p->prmt_paste.active = 1;
+        p->prmt_paste.match = 0;
+        p->prmt_paste.len = 0;
+        return NULL;
+    }
+
+    // nor is an answer, and it doesn't end a key sequence being typed
+    if (input->tch_type == TCHTYPE_CTRL && input->tch_ctrl.value == TCHCTRL_REPORT) {
+        __prompt_report(input);
+        return NULL;
+    }
+
+    if (prompt_keymap_init())
+        return PRMT_ABRT;
+
+    // control keys with modifiers do what they do without them, unless bound themselves
+    uint32_t key = __prompt_key(input);
+    struct prompt_keymap_ent *ent = prompt_keymap_find(p->prmt_keynode, key);
+    if (!ent && input->tch_type == TCHTYPE_CTRL && input->tch_mods)
+        ent = prompt_keymap_find(p->prmt_keynode, key & 0xffffff);
+
+    // an unbound key ends a sequence, which is dropped whole
+    p->prmt_keynode = 0;
+    if (!ent)
+        return NULL;
+    if (ent->child) {
+        p->prmt_keynode = ent->child;
+        return NULL;
+    }
+    return (ent->fn ? prompt_fns[ent->fn].fn(p) : NULL);
+}
+
+/**
+ * decodes byte `c` of input and applies the key it completes, if any, counting it in `keys`.
+ * a bracketed paste is collected whole and counts as one key.
+ * returns what __prompt_output() does, or NULL while a key is incomplete.
+ */
+static const char *__prompt_input(struct prompt *p, struct __termchar *termchar, int c, size_t *keys)
+{
+    const char *ret = NULL;
+    int termchar_ret;
+
+    if (p->prmt_paste.active) {
+        // collect the whole paste so it's inserted at once
+        termchar_ret = __prompt_paste_feed(&p->prmt_paste, c);
+        if (1 == termchar_ret) {
+            (*keys)++;
+            if (__prompt_output_paste(p))
+                termchar_ret = -1;
+        }
+        return (-1 == termchar_ret ? PRMT_ABRT : NULL);
+    }
+
+    termchar_ret = __termchar_input(termchar, c);
+    if (0 == termchar_ret)
+        return NULL; // need more
+
+    // termchar_ret == 1, or -1 to ignore invalid input
+    if (1 == termchar_ret) {
+        (*keys)++;
+        ret = __prompt_output(p, termchar);
+    }
+    memset(termchar, 0, sizeof(*termchar));
+    return ret;
+}
+
+/**
+ * starts a new line on a screen of `width` columns and `height` rows, with the settings from the environment.
+ */
+static void __prompt_start(struct prompt *p, const char *ps1, size_t width, size_t height)
+{
+    __prompt_reset(p, ps1);
+    p->prmt_screen.width = width;
+    p->prmt_screen.height = height;
+    p->prmt_screen.hscroll = (getenv("RMSH_HSCROLL") && strcmp(getenv("RMSH_HSCROLL"), "0") && *getenv("RMSH_HSCROLL"));
+    p->prmt_escdelay = __prompt_escdelay();
+}
+
+static const char *prompt(struct prompt *p, struct termios *termios_p)
+{
+    const char *ret = PRMT_ABRT;
+    struct termios raw_termios;
+    struct prompt_loop loop;
+    int loop_open = 0;
+    
+    char *ps1;
+
+    struct __termchar termchar;
+    size_t keys, unflushed = 0; // keys whose frame wasn't written yet
+    struct timespec read_at;    // when they were read
+    size_t cols, rows;
+    ssize_t n;
+    int ev;
+
+    // set terminal to raw mode
+    memcpy(&raw_termios, termios_p, sizeof(raw_termios));
+    raw_termios.c_iflag &= ~(IXON);
+    raw_termios.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    ASSERT_PERROR(tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_termios) == 0, "tcsetattr");
+
+    // resizes and signals come as events, so reads are never interrupted
+    ASSERT_PERROR(prompt_loop_open(&loop) == 0, "prompt_loop_open");
+    loop_open = 1;
+
+    // the answers come as input, while the terminal is still raw
+    prompt_term_query();
+    if (prompt_term.paste)
+        prompt_frame_puts(VT_PASTE_ON);
+
+    ps1 = (getenv("PS1") ?: (getuid() ? "$ " : "# "));
+
+    cols = __prompt_term_size(STDOUT_FILENO, &rows);
+    __prompt_start(p, ps1, cols, rows);
+    ASSERT_PERROR(__prompt_render(p) == 0, "__prompt_render");
+
+    ret = NULL;
+    memset(&termchar, 0, sizeof(termchar));
+    // keys read ahead during the last line count from when this one starts
+    clock_gettime(CLOCK_MONOTONIC, &read_at);
+    while (!ret)
+    {
+        if (!prompt_input_pending(&p->prmt_input)) {
+            ASSERT_PERROR(prompt_frame_flush(STDOUT_FILENO) == 0, "prompt_frame_flush");
+            if (unflushed)
+                prompt_hist_add(&prompt_stat.latency, prompt_stat_since(&read_at), unflushed);
+            unflushed = 0;
+
+            // an escape sequence cut short is the escape key (or an alt-prefixed one) unless the rest comes soon
+            ASSERT_PERROR(prompt_loop_timer(&loop, (__termchar_escape(&termchar) ? p->prmt_escdelay : -1)) == 0, "prompt_loop_timer");
+            ASSERT_PERROR((ev = prompt_loop_wait(&loop)) != -1, "prompt_loop_wait");
+
+            if (ev & PRMT_EV_WINCH) {
+                cols = __prompt_term_size(STDOUT_FILENO, &rows);
+                __prompt_resize(p, cols, rows);
+                ASSERT_PERROR(__prompt_render(p) == 0, "__prompt_render");
+            }
+
+            // an interrupt from outside drops the line, like ^C
+            if (ev & PRMT_EV_INT) {
+                ret = __prompt_fn_abort_line(p);
+                continue;
+            }
+
+            if ((ev & PRMT_EV_TIMER) && !(ev & PRMT_EV_INPUT) && __termchar_escape(&termchar)) {
+                if (1 == __termchar_timeout(&termchar)) {
+                    clock_gettime(CLOCK_MONOTONIC, &read_at);
+                    unflushed = 1;
+                    prompt_stat.keys++;
+                    if (!(ret = __prompt_output(p, &termchar)) && __prompt_render(p))
+                        ret = PRMT_ABRT;
+                }
+                memset(&termchar, 0, sizeof(termchar));
+                continue;
+            }
+
+            if (!(ev & PRMT_EV_INPUT))
+                continue;
+
+            n = prompt_input_fill(&p->prmt_input, STDIN_FILENO);
+            if (0 >= n) {
+                if (n)
+                    perror("read");
+                ret = (n ? PRMT_ABRT : PRMT_EXIT);
+                goto out;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &read_at);
+        }
+
+        // decode every complete sequence, a partial one continues after the next read.
+        // edits are applied as they come and rendered once, so a burst of keys costs a single frame.
+        keys = 0;
+        while (!ret && prompt_input_pending(&p->prmt_input))
+            ret = __prompt_input(p, &termchar, prompt_input_getc(&p->prmt_input), &keys);
+
+        prompt_stat.keys += keys;
+        unflushed += keys;
+        if (keys > 1)
+            prompt_stat.skipped += keys - 1;
+        if (!ret && keys && __prompt_render(p))
+            ret = PRMT_ABRT;
+    }
+
+out:
+    if (prompt_term.paste)
+        prompt_frame_puts(VT_PASTE_OFF);
+    if (0 == prompt_frame_flush(STDOUT_FILENO) && unflushed)
+        prompt_hist_add(&prompt_stat.latency, prompt_stat_since(&read_at), unflushed);
+    if (loop_open)
+        prompt_loop_close(&loop);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, termios_p);
+    return ret;
+}
+
+/**
+ * writes the frame to `fd` and to `vt`.
+ * returns 0 on success and -1 on error.
+ */
+static int __prompt_replay_flush(struct vt *vt, int fd)
+{
+    prompt_frame_end();
+    vt_feed(vt, prompt_frame.buf, prompt_frame.len);
+    return prompt_frame_flush(fd);
+}
+
+/**
+ * feeds recorded terminal input through the line editor without a terminal, as if every key was
+ * typed once the frame of the previous one was written to `fd` and to `vt`, whose width is used.
+ * after every frame, `vt` is checked to show the prompt where the renderer believes it is.
+ * accepted lines go to the history and start a new line instead of running.
+ * a recording has no timing, so only an escape it ends with is taken as the escape key.
+ * returns the amount of frames `vt` didn't match, or -1 on error.
+ */
+static ssize_t prompt_replay(struct prompt *p, const char *ps1, struct vt *vt, const unsigned char *buf, size_t n, int fd)
+{
+    struct prompt_screen *scr = &p->prmt_screen;
+    struct __termchar termchar = {0};
+    struct timespec key_at;
+    const char *ret = NULL;
+    size_t keys = 0, prev, top;
+    ssize_t bad = 0;
+    uint64_t ns;
+
+    // the virtual terminal has synchronized output, every frame must end the update it begins
+    prompt_term.sync = 1;
+    __prompt_start(p, ps1, vt->cols, vt->rows);
+    top = vt->y + vt->scrolled;
+    if (__prompt_render(p) || __prompt_replay_flush(vt, fd))
+        return -1;
+    bad += !!vt_check(vt, (ssize_t)top - (ssize_t)vt->scrolled, scr->text, scr->len, scr->cur);
+
+    clock_gettime(CLOCK_MONOTONIC, &key_at);
+    for (size_t i = 0; i <= n; i++) {
+        prev = keys;
+        if (i < n)
+            ret = __prompt_input(p, &termchar, buf[i], &keys);
+        else if (__termchar_escape(&termchar) && 1 == __termchar_timeout(&termchar)) {
+            keys++;
+            ret = __prompt_output(p, &termchar);
+        }
+        if (keys == prev && !ret)
+            continue;
+
+        if (PRMT_ABRT == ret)
+            return -1;
+        if (ret && PRMT_EXIT != ret && *ret && history_add(ret))
+            return -1;
+        if (ret) {
+            // the next line starts where leaving this one took the cursor
+            if (__prompt_replay_flush(vt, fd))
+                return -1;
+            __prompt_start(p, ps1, vt->cols, vt->rows);
+            top = vt->y + vt->scrolled;
+        }
+        ret = NULL;
+        if (__prompt_render(p) || __prompt_replay_flush(vt, fd))
+            return -1;
+        if (scr->home) {
+            top = vt->scrolled;
+            scr->home = 0;
+        }
+
+        // checking the screen isn't part of the key
+        ns = prompt_stat_since(&key_at);
+        prompt_stat.keys += keys - prev;
+        prompt_hist_add(&prompt_stat.latency, ns, keys - prev);
+        bad += (vt->sync || vt_check(vt, (ssize_t)top - (ssize_t)vt->scrolled, scr->text, scr->len, scr->cur));
+        clock_gettime(CLOCK_MONOTONIC, &key_at);
+    }
+    return bad;
+}
+
+///////
+// Lex
+///////
+
+static const char *IFS = " \t\n";
+
+#define LEX_BLANK " \t"
+#define LEX_META  "|;\n<>"
+
+/**
+ * returns element `idx` of variable `name` (`len` bytes, not null terminated) or NULL if unset.
+ * scalars are arrays of a single element. if `out_count` is not NULL, it is set to the amount of elements.
+ */
+typedef const char *(*lex_lookup_t)(void *ctx, const char *name, size_t len, size_t idx, size_t *out_count);
+
+struct lex {
+    const char *shname;
+
+    lex_lookup_t lookup;
+    void        *lookup_ctx;
+};
+
+enum {
+    LEX_SUBST_NONE = 0,
+    LEX_SUBST_READ,  // <(list)
+    LEX_SUBST_WRITE, // >(list)
+};
+
+enum {
+    LEX_REDIR_NONE = 0,
+    LEX_REDIR_IN,     // [N]<path
+    LEX_REDIR_OUT,    // [N]>path
+    LEX_REDIR_APPEND, // [N]>>path
+};
+
+struct lex_subst {
+    size_t argi;  // index in argv replaced by the substitution
+    size_t redir; // if not 0, replaces the path of redirection `redir - 1` instead
+    int dir;      // LEX_SUBST_*
+    char *list;
+};
+
+struct lex_redir {
+    int fd;
+    int type; // LEX_REDIR_*
+    char *path;
+};
+
+struct lex_proc {
+    char **argv;
+
+    char **assigns; // leading `NAME=value` words, NULL terminated
+    size_t nassigns;
+
+    struct lex_subst *substs;
+    size_t nsubsts;
+
+    struct lex_redir *redirs;
+    size_t nredirs;
+};
+
+static void free_lex_proc(struct lex_proc *p) {
+
+    if (p->argv) {
+        for (char **arg = p->argv; *arg; arg++)
+            free(*arg);
+        free(p->argv);
+    }
+
+    if (p->assigns) {
+        for (size_t i = 0; i < p->nassigns; i++)
+            free(p->assigns[i]);
+        free(p->assigns);
+    }
+
+    if (p->substs) {
+        for (size_t i = 0; i < p->nsubsts; i++)
+            free(p->substs[i].list);
+        free(p->substs);
+    }
+
+    if (p->redirs) {
+        for (size_t i = 0; i < p->nredirs; i++)
+            free(p->redirs[i].path);
+        free(p->redirs);
+    }
+
+    free(p);
+}
+
+#define LEX_ERR(Lex, Fmt, ...) printf("%s: " Fmt, (Lex)->shname, ##__VA_ARGS__)
+
+struct lex_token {
+    char *word;  // NULL at the end of the process, or for redirection operators
+    int subst;   // LEX_SUBST_*, `word` is the inner list
+    int redir;   // LEX_REDIR_*
+    int redir_fd;
+    int assign;  // `word` is `NAME=value`
+    int null;    // unquoted word expanded to nothing, should be dropped
+
+    // words completed before `word` by array expansions
+    char **words;
+    size_t nwords;
+    int empty_array;
+};
+
+/**
+ * appends `n` bytes of `s` to the null terminated `*tok` of size `*n_tok`.
+ */
+static int lex_append(char **tok, size_t *n_tok, const char *s, size_t n)
+{
+    char *newtok = realloc(*tok, *n_tok + n + 1); // +1 for \0
+    if (!newtok)
+        return -1;
+    memcpy(newtok + *n_tok, s, n);
+    *n_tok += n;
+    newtok[*n_tok] = 0;
+    *tok = newtok;
+    return 0;
+}
+
+static int lex_isname(int c, int first)
+{
+    return c == '_' || isalpha(c) || (!first && isdigit(c));
+}
+
+/**
+ * pushes the word in `*tok` to the words completed before it, and starts a new one.
+ */
+static int lex_split_word(struct lex_token *out, char **tok, size_t *n_tok)
+{
+    char **words;
+    if (!*tok && 0 != lex_append(tok, n_tok, "", 0))
+        return -1;
+    if (!(words = realloc(out->words, (out->nwords + 1) * sizeof(char *))))
+        return -1;
+    out->words = words;
+    out->words[out->nwords++] = *tok;
+    *tok = NULL;
+    *n_tok = 0;
+    return 0;
+}
+
+/**
+ * expands the parameter at `input` (right after `$`) into `*tok`.
+ * supports `$NAME`, `$?`, `${NAME}`, `${NAME[N]}`, `${#NAME}`, `${#NAME[@]}` and `${NAME[@]}`
+ * (or `[*]`), which expands into a word per element, completing every word but the last into `out`.
+ * a lone `$` is kept as is.
+ */
+static int lex_parse_param(struct lex *lex, const char *input, char **tok, size_t *n_tok, struct lex_token *out, const char **endp)
+{
+    const char *name = input;
+    const char *end;
+    const char *value;
+    int length = 0;
+    int all = 0;
+    size_t idx = 0;
+    size_t count = 0;
+
+    if (*input != '{') {
+        if (*name == '?')
+            end = name + 1;
+        else
+            for (end = name; lex_isname(*end, end == name); end++);
+
+        if (end == name) {
+            *endp = input;
+            return lex_append(tok, n_tok, "$", 1);
+        }
+
+        value = (lex->lookup ? lex->lookup(lex->lookup_ctx, name, end - name, 0, NULL) : NULL);
+        *endp = end;
+        return (value ? lex_append(tok, n_tok, value, strlen(value)) : 0);
+    }
+
+    name++; // skip `{`
+    if (*name == '#' && name[1] != '}') {
+        length = 1;
+        name++;
+    }
+
+    if (*name == '?')
+        end = name + 1;
+    else
+        for (end = name; lex_isname(*end, end == name); end++);
+
+    if (end != name && *end == '[') {
+        const char *sub = end + 1;
+        if ((*sub == '@' || *sub == '*') && sub[1] == ']') {
+            all = 1;
+            *endp = sub + 2;
+        }
+        else {
+            char *sub_end;
+            idx = strtoul(sub, &sub_end, 10);
+            *endp = (sub_end != sub && *sub_end == ']' && isdigit(*sub) ? sub_end + 1 : sub);
+        }
+    }
+    else
+        *endp = end;
+
+    if (end == name || **endp != '}' || (!all && *endp == end + 1)) {
+        LEX_ERR(lex, "${%.*s}: bad substitution\n", (int)strcspn(input + 1, "}"), input + 1);
+        return -1;
+    }
+    (*endp)++; // skip `}`
+
+    value = (lex->lookup ? lex->lookup(lex->lookup_ctx, name, end - name, idx, &count) : NULL);
+
+    if (length) {
+        char buf[32];
+        ssize_t n = (all ? (ssize_t)count : (value ? utf8_strlen(value) : 0));
+        if (n == -1)
+            n = strlen(value); // not utf8, count bytes
+        snprintf(buf, sizeof(buf), "%zd", n);
+        return lex_append(tok, n_tok, buf, strlen(buf));
+    }
+
+    if (!all)
+        return (value ? lex_append(tok, n_tok, value, strlen(value)) : 0);
+
+    if (!count)
+        out->empty_array = 1;
+
+    for (size_t i = 0; i < count; i++) {
+        if (i && 0 != lex_split_word(out, tok, n_tok))
+            return -1;
+        value = lex->lookup(lex->lookup_ctx, name, end - name, i, NULL);
+        if (0 != lex_append(tok, n_tok, (value ?: ""), (value ? strlen(value) : 0)))
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * parses a single word into `out`, expanding parameters and removing quotes.
+ * `out->word` is NULL if nothing but blanks were left before the end of the process.
+ */
+static int lex_parse_token(struct lex *lex, const char *input, struct lex_token *out, const char **endp)
+{
+    int ret = -1;
+    int dquote = 0;
+    int quoted = 0;
+    int expanded = 0;
+    const char *curr;
+
+    char  *tok = NULL;
+    size_t n_tok = 0;
+
+    memset(out, 0, sizeof(*out));
+
+    // skip leading blanks
+    for (curr = input; *curr && strchr(LEX_BLANK, *curr); curr++);
+
+    if ((curr[0] == '<' || curr[0] == '>') && curr[1] == '(') {
+        const char *start = curr + 2;
+        int depth = 1;
+
+        out->subst = (curr[0] == '<' ? LEX_SUBST_READ : LEX_SUBST_WRITE);
+        for (curr = start; *curr; curr++) {
+            if (*curr == '(')
+                depth++;
+            else if (*curr == ')' && !--depth)
+                break;
+        }
+
+        if (!*curr) {
+            LEX_ERR(lex, "unexpected EOF while looking for matching `)'\n");
+            goto out;
+        }
+
+        if (!(tok = strndup(start, curr - start)))
+            goto out;
+        curr++; // skip `)`
+        goto done;
+    }
+
+    if (curr[0] == '<' || curr[0] == '>') {
+        out->redir_fd = (curr[0] == '<' ? STDIN_FILENO : STDOUT_FILENO);
+        out->redir = (curr[0] == '<' ? LEX_REDIR_IN : LEX_REDIR_OUT);
+        if (curr[0] == '>' && curr[1] == '>') {
+            out->redir = LEX_REDIR_APPEND;
+            curr++;
+        }
+        curr++;
+        goto done;
+    }
+
+    for (; *curr; curr++) {
+        // blanks and metacharacters end the word
+        if (!dquote && strchr(LEX_BLANK LEX_META, *curr)) {
+            // `N>` redirects fd N
+            if (!quoted && !expanded && tok && (*curr == '<' || *curr == '>') && curr[1] != '(' &&
+                strspn(tok, "0123456789") == n_tok && n_tok < 4) {
+                struct lex_token redir;
+                if (0 != lex_parse_token(lex, curr, &redir, &curr))
+                    goto out;
+                *out = redir;
+                out->redir_fd = atoi(tok);
+                free(tok);
+                tok = NULL;
+                goto done;
+            }
+            break;
+        }
+
+        if (*curr == '\\' && curr[1] && (!dquote || strchr("$`\"\\\n", curr[1]))) {
+            curr++;
+            if (*curr != '\n' && 0 != lex_append(&tok, &n_tok, curr, 1)) // backslash-newline is removed
+                goto out;
+            quoted = 1;
+            continue;
+        }
+
+        if (*curr == '\'' && !dquote) {
+            const char *end = strchr(curr + 1, '\'');
+            if (!end) {
+                LEX_ERR(lex, "unexpected EOF while looking for matching `''\n");
+                goto out;
+            }
+            if (0 != lex_append(&tok, &n_tok, curr + 1, end - (curr + 1)))
+                goto out;
+            quoted = 1;
+            curr = end;
+            continue;
+        }
+
+        if (*curr == '"') {
+            dquote = !dquote;
+            quoted = 1;
+            continue;
+        }
+
+        if (*curr == '$') {
+            if (0 != lex_parse_param(lex, curr + 1, &tok, &n_tok, out, &curr))
+                goto out;
+            curr--; // loop increments
+            expanded = 1;
+            continue;
+        }
+
+        if (*curr == '=' && !quoted && !expanded && tok && !out->assign) {
+            size_t i;
+            for (i = 0; i < n_tok && lex_isname(tok[i], i == 0); i++);
+            out->assign = (i == n_tok);
+        }
+
+        if (0 != lex_append(&tok, &n_tok, curr, 1))
+            goto out;
+    }
+
+    if (dquote) {
+        LEX_ERR(lex, "unexpected EOF while looking for matching `\"'\n");
+        goto out;
+    }
+
+    // `""` is an empty word, but an unquoted expansion to nothing (or `"${a[@]}"` of an empty array) is no word at all
+    if (!tok && (quoted || expanded)) {
+        if (!(tok = strdup("")))
+            goto out;
+        out->null = !quoted;
+    }
+    if (tok && !*tok && out->empty_array && !out->nwords)
+        out->null = 1;
+
+done:
+    if (endp)
+        *endp = curr;
+    out->word = tok;
+    ret = 0;
+out:
+    if (ret) {
+        if (tok)
+            free(tok);
+        for (size_t i = 0; i < out->nwords; i++)
+            free(out->words[i]);
+        if (out->words)
+            free(out->words);
+        out->words = NULL;
+        out->nwords = 0;
+    }
+    return ret;
+}
+
+/**
+ * appends `word` to the NULL terminated array `*arr` of `*n` elements.
+ * consumes ownership of `word` even on failure.
+ */
+static int lex_push(char ***arr, size_t *n, char *word)
+{
+    char **newarr = realloc(*arr, (*n + 2) * sizeof(char *));
+    if (!newarr) {
+        free(word);
+        return -1;
+    }
+    newarr[(*n)++] = word;
+    newarr[*n] = NULL;
+    *arr = newarr;
+    return 0;
+}
+
+/**
+ * records the process substitution list in `*word` and replaces it with a placeholder,
+ * which is replaced by the pipe path when launched.
+ * on failure `*word` is freed and NULL.
+ */
+static int lex_add_subst(struct lex_proc *p, char **word, int dir, size_t argi, size_t redir)
+{
+    struct lex_subst *substs = realloc(p->substs, (p->nsubsts + 1) * sizeof(*substs));
+    if (!substs) {
+        free(*word);
+        *word = NULL;
+        return -1;
+    }
+    p->substs = substs;
+    p->substs[p->nsubsts].argi = argi;
+    p->substs[p->nsubsts].redir = redir;
+    p->substs[p->nsubsts].dir = dir;
+    p->substs[p->nsubsts].list = *word;
+    p->nsubsts++;
+
+    return (!(*word = strdup("")) ? -1 : 0);
+}
+
+static int lex_parse_proc(struct lex *lex, const char *input, struct lex_proc **outp, const char **endp)
+{
+    int ret = -1;
+    size_t nargv = 0;
+    struct lex_proc *p = NULL;
+
+    if (!(p = calloc(1, sizeof(*p))))
+        goto out;
+    
+    if (!(p->argv = calloc(1, sizeof(char *))))
+        goto out;
+
+    while (*input) {
+        struct lex_token tok;
+        if (0 != lex_parse_token(lex, input, &tok, &input))
+            goto out;
+
+        if (tok.redir) {
+            struct lex_redir *redirs;
+            struct lex_token path;
+
+            if (0 != lex_parse_token(lex, input, &path, &input))
+                goto out;
+            if (path.nwords) {
+                for (size_t i = 0; i < path.nwords; i++)
+                    free(path.words[i]);
+                free(path.words);
+                free(path.word);
+                LEX_ERR(lex, "ambiguous redirect\n");
+                goto out;
+            }
+            if (!path.word || path.redir) {
+                if (path.word)
+                    free(path.word);
+                LEX_ERR(lex, "syntax error near unexpected token `%c'\n", (*input ?: '\n'));
+                goto out;
+            }
+
+            if (!(redirs = realloc(p->redirs, (p->nredirs + 1) * sizeof(*redirs)))) {
+                free(path.word);
+                goto out;
+            }
+            p->redirs = redirs;
+            p->redirs[p->nredirs].fd = tok.redir_fd;
+            p->redirs[p->nredirs].type = tok.redir;
+            p->redirs[p->nredirs].path = path.word;
+            p->nredirs++;
+
+            // `< <(list)` redirects from a process substitution
+            if (path.subst && 0 != lex_add_subst(p, &p->redirs[p->nredirs - 1].path, path.subst, 0, p->nredirs))
+                goto out;
+            continue;
+        }
+
+        // words completed by array expansions come first
+        for (size_t i = 0; i < tok.nwords; i++) {
+            if (0 != lex_push(&p->argv, &nargv, tok.words[i])) {
+                for (i++; i < tok.nwords; i++)
+                    free(tok.words[i]);
+                free(tok.words);
+                free(tok.word);
+                goto out;
+            }
+        }
+        if (tok.words)
+            free(tok.words);
+
+        if (!tok.word)
+            break; // only blanks left or end of process
+
+        if (tok.null) {
+            free(tok.word);
+            continue;
+        }
+
+        if (tok.assign && !nargv) {
+            if (0 != lex_push(&p->assigns, &p->nassigns, tok.word))
+                goto out;
+            continue;
+        }
+
+        if (tok.subst != LEX_SUBST_NONE && 0 != lex_add_subst(p, &tok.word, tok.subst, nargv, 0))
+            goto out;
+
+        if (0 != lex_push(&p->argv, &nargv, tok.word))
+            goto out;
+    }
+
+    if (endp)
+        *endp = input;
+    *outp = p;
+    ret = 0;
+out:
+    if (ret)
+        free_lex_proc(p);
+    return ret;
+}
+
+struct lex_pipeline {
+    struct lex_proc **procs;
+    size_t nprocs;
+    int pipestat; // `pipestat proc [| proc]...`
+};
+
+static void free_lex_pipeline(struct lex_pipeline *pl) {
+    if (pl->procs) {
+        for (size_t i = 0; i < pl->nprocs; i++)
+            if (pl->procs[i])
+                free_lex_proc(pl->procs[i]);
+        free(pl->procs);
+    }
+
+    free(pl);
+}
+
+static int lex_proc_empty(struct lex_proc *p) {
+    return !p->argv[0] && !p->nassigns && !p->nredirs;
+}
+
+/**
+ * parses `proc [| proc]...` up to the end of the list (`;`, newline or end of input).
+ * an empty input results in an empty pipeline.
+ */
+static int lex_parse_pipeline(struct lex *lex, const char *input, struct lex_pipeline **outp, const char **endp)
+{
+    int ret = -1;
+    const char *curr;
+    struct lex_pipeline *pl = NULL;
+
+    if (!(pl = calloc(1, sizeof(*pl))))
+        goto out;
+
+    // `pipestat` is a reserved word profiling the entire pipeline, like `time`
+    for (curr = input; *curr && strchr(LEX_BLANK, *curr); curr++);
+    if (!strncmp(curr, "pipestat", 8) && (!curr[8] || strchr(LEX_BLANK LEX_META, curr[8]))) {
+        pl->pipestat = 1;
+        input = curr + 8;
+    }
+
+    while (1) {
+        struct lex_proc *proc;
+        struct lex_proc **procs;
+
+        if (0 != lex_parse_proc(lex, input, &proc, &input))
+            goto out;
+
+        if (!(procs = realloc(pl->procs, (pl->nprocs + 1) * sizeof(*procs)))) {
+            free_lex_proc(proc);
+            goto out;
+        }
+        pl->procs = procs;
+        pl->procs[pl->nprocs++] = proc;
+
+        if (*input != '|')
+            break;
+        
+        if (lex_proc_empty(proc)) {
+            LEX_ERR(lex, "syntax error near unexpected token `|'\n");
+            goto out;
+        }
+        input++; // skip `|`
+    }
+
+    // single empty process is an empty pipeline, but `a |` is missing a process
+    if (lex_proc_empty(pl->procs[pl->nprocs - 1])) {
+        if (pl->nprocs > 1) {
+            LEX_ERR(lex, "syntax error: unexpected end of file\n");
+            goto out;
+        }
+        free_lex_proc(pl->procs[0]);
+        pl->nprocs = 0;
+    }
+
+    if (endp)
+        *endp = input;
+    *outp = pl;
+    ret = 0;
+out:
+    if (ret && pl)
+        free_lex_pipeline(pl);
+    return ret;
+}
+
+/////////////
+// Interpreter
+/////////////
+
+/**
+ * TODO:
+ * . simple commands
+ * . lists
+ * .. && ||
+ * . compound commands
+ * .. (list)
+ * .. { list; }
+ * .. ((expression))
+ * .. [[ expression ]]
+ * . parameters
+ * . special parameters
+ * . arrays
+ * . expansion
+ * .. brace
+ * .. tilde
+ * .. parameter
+ * .. command substitution
+ * .. arithmetic
+ * .. word splitting
+ * .. pathname
+ * .. pattern matching
+ * . aliases
+ * . functions
+ * 
+ */
+
+struct rmsh_var {
+    struct rmsh_var *next;
+    char *name;
+
+    // scalars are arrays of a single element
+    char **values;
+    size_t nvalues;
+    char  *arena; // if set, `values` point into it instead of being allocated one by one
+};
+
+/**
+ * the terminal of an interactive shell.
+ * jobs run in a process group of their own, which is handed the terminal while it runs, so it reads what's
+ * typed and gets ^C and ^Z while the shell doesn't. typed-ahead input the job leaves unread stays in the
+ * terminal for the next prompt, after what the prompt itself read ahead and couldn't put back.
+ */
+struct rmsh_tty {
+    pid_t pgid;                 // the shell's process group
+    struct termios *termios;    // modes jobs are given the terminal with
+    struct prompt_input *input; // typed-ahead bytes, the next prompt decodes them first
+    int given;                  // a job has the terminal
+    int stopped;                // the signal that suspended the job, 0 unless it was
+};
+
+struct rmsh {
+    const char *shname;
+    int last_exit_status;
+    char last_exit_status_s[16]; // `$?`
+
+    struct rmsh_var *vars;
+
+    struct rmsh_tty *tty; // NULL unless interactive
+    pid_t job_pgid;       // process group of the pipeline being launched, 0 before its first process
+};
+
+#define RMSH_STRERR(Sh, Errno) fprintf(stderr, "%s: %s\n", (Sh)->shname, strerror(Errno))
+#define RMSH_SYSERR(Sh) RMSH_STRERR((Sh), errno)
+
+#define RMSH_ERRMSG(Sh, Msg) fprintf(stderr, "%s: %s\n", (Sh)->shname, (Msg))
+#define RMSH_STRERRMSG(Sh, Errno, Msg) fprintf(stderr, "%s: %s: %s\n", (Sh)->shname, (Msg), strerror(Errno))
+#define RMSH_SYSERRMSG(Sh, Msg) RMSH_STRERRMSG((Sh), errno, (Msg))
+
+#define RMSH_ERRFMT(Sh, Fmt, ...) fprintf(stderr, "%s: " Fmt "\n", (Sh)->shname, ##__VA_ARGS__)
+#define RMSH_STRERRFMT(Sh, Errno, Fmt, ...) fprintf(stderr, "%s: " Fmt ": %s\n", (Sh)->shname, ##__VA_ARGS__, strerror(Errno))
+#define RMSH_SYSERRFMT(Sh, Fmt, ...) RMSH_STRERRFMT((Sh), errno, Fmt, ##__VA_ARGS__)
+
+static int rmsh_open(const char *shname, struct rmsh *out_sh)
 {
-    if (p->prmt_srch_line)
-        return 0; // already in search, ignore
-    
-    const char *curr_line = __prompt_get(p, p->prmt_cur_row);
-    size_t curr_line_sz = (curr_line ? strlen(curr_line) : 0);
+    memset(out_sh, 0, sizeof(*out_sh));
+    out_sh->shname = shname;
+    out_sh->last_exit_status = 0;
+    return 0;
+}
 
-    // initialize search line with searchbar and current line, put null terminator at the end
-    if (!(p->prmt_srch_line = malloc(PRMT_SRCH_TLEN + curr_line_sz + 1))) // +1 for \0
+static void rmsh_var_clear(struct rmsh_var *v)
+{
+    if (v->arena)
+        free(v->arena);
+    else
+        for (size_t i = 0; i < v->nvalues; i++)
+            free(v->values[i]);
+    if (v->values)
+        free(v->values);
+    v->values = NULL;
+    v->nvalues = 0;
+    v->arena = NULL;
+}
+
+static void rmsh_close(struct rmsh *sh)
+{
+    while (sh->vars) {
+        struct rmsh_var *next = sh->vars->next;
+        rmsh_var_clear(sh->vars);
+        free(sh->vars->name);
+        free(sh->vars);
+        sh->vars = next;
+    }
+}
+
+static struct rmsh_var *rmsh_var_find(struct rmsh *sh, const char *name, size_t len)
+{
+    for (struct rmsh_var *v = sh->vars; v; v = v->next)
+        if (!strncmp(v->name, name, len) && !v->name[len])
+            return v;
+    return NULL;
+}
+
+/**
+ * returns the value of a shell variable, falling back to the environment, or NULL if unset.
+ */
+static const char *rmsh_var_get(struct rmsh *sh, const char *name)
+{
+    struct rmsh_var *v = rmsh_var_find(sh, name, strlen(name));
+    if (!v)
+        return getenv(name);
+    return (v->nvalues ? v->values[0] : NULL);
+}
+
+/**
+ * finds or creates variable `name`, without any value.
+ */
+static struct rmsh_var *rmsh_var_new(struct rmsh *sh, const char *name)
+{
+    struct rmsh_var *v = rmsh_var_find(sh, name, strlen(name));
+
+    if (v) {
+        rmsh_var_clear(v);
+        return v;
+    }
+
+    if (!(v = calloc(1, sizeof(*v))) || !(v->name = strdup(name))) {
+        free(v);
+        return NULL;
+    }
+    v->next = sh->vars;
+    sh->vars = v;
+    return v;
+}
+
+/**
+ * sets variable `name` to an array, consuming ownership of `values` and `arena` even on failure.
+ * if `arena` is not NULL, `values` point into it.
+ */
+static int rmsh_var_set_array(struct rmsh *sh, const char *name, char **values, size_t nvalues, char *arena)
+{
+    struct rmsh_var *v = rmsh_var_new(sh, name);
+
+    if (!v) {
+        if (arena)
+            free(arena);
+        else
+            for (size_t i = 0; i < nvalues; i++)
+                free(values[i]);
+        free(values);
         return -1;
-    memcpy(p->prmt_srch_line, PRMT_SRCH_TEXT, PRMT_SRCH_TLEN);
-    memcpy(p->prmt_srch_line + PRMT_SRCH_TLEN, curr_line, curr_line_sz);
-    p->prmt_srch_line[PRMT_SRCH_TLEN + curr_line_sz] = 0;
-    p->prmt_srch_line_sz = PRMT_SRCH_TLEN + curr_line_sz;
-    p->prmt_srch_query_sz = 0;
+    }
+
+    v->values = values;
+    v->nvalues = nvalues;
+    v->arena = arena;
+    return 0;
+}
+
+/**
+ * sets (or unsets if `value` is NULL) a shell variable.
+ * variables which came from the environment are updated there too, so programs see them.
+ * returns 0 on success and -1 on failure.
+ */
+static int rmsh_var_set(struct rmsh *sh, const char *name, const char *value)
+{
+    struct rmsh_var **pv;
+    struct rmsh_var *v;
+    char **values;
+
+    if (getenv(name) && 0 != (value ? setenv(name, value, 1) : unsetenv(name)))
+        return -1;
+
+    if (!value) {
+        for (pv = &sh->vars; *pv && strcmp((*pv)->name, name); pv = &(*pv)->next);
+        if ((v = *pv)) {
+            *pv = v->next;
+            rmsh_var_clear(v);
+            free(v->name);
+            free(v);
+        }
+        return 0;
+    }
+
+    if (!(values = malloc(sizeof(char *))))
+        return -1;
+    if (!(values[0] = strdup(value))) {
+        free(values);
+        return -1;
+    }
+    return rmsh_var_set_array(sh, name, values, 1, NULL);
+}
+
+/**
+ * sets a `NAME=value` assignment.
+ */
+static int rmsh_var_assign(struct rmsh *sh, const char *assign)
+{
+    int ret;
+    const char *eq = strchr(assign, '=');
+    char *name = strndup(assign, eq - assign);
+    if (!name)
+        return -1;
+    ret = rmsh_var_set(sh, name, eq + 1);
+    free(name);
+    return ret;
+}
+
+/**
+ * parameter lookup for the lexer.
+ */
+static const char *rmsh_lookup(void *ctx, const char *name, size_t len, size_t idx, size_t *out_count)
+{
+    struct rmsh *sh = ctx;
+    struct rmsh_var *v;
+    const char *value = NULL;
+    char envname[256];
+
+    if (len == 1 && *name == '?') {
+        snprintf(sh->last_exit_status_s, sizeof(sh->last_exit_status_s), "%d", sh->last_exit_status);
+        value = sh->last_exit_status_s;
+    }
+    else if ((v = rmsh_var_find(sh, name, len))) {
+        if (out_count)
+            *out_count = v->nvalues;
+        return (idx < v->nvalues ? v->values[idx] : NULL);
+    }
+    else if (len < sizeof(envname)) {
+        memcpy(envname, name, len);
+        envname[len] = 0;
+        value = getenv(envname);
+    }
+
+    if (out_count)
+        *out_count = !!value;
+    return (idx ? NULL : value);
+}
+
+/////////////
+// Builtins
+/////////////
+
+struct rmsh_builtin {
+    const char *name;
+    int (*fn)(struct rmsh *sh, int argc, char **argv); // returns exit status
+};
+
+/**
+ * writes the entire buffer, retrying partial writes.
+ * returns 0 on success and -1 on failure.
+ */
+static int write_all(int fd, const void *buf, size_t n)
+{
+    while (n) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char *)buf + w;
+        n -= w;
+    }
+    return 0;
+}
+
+#define TEE_BUFSZ (128 * 1024)
+
+struct tee_out {
+    const char *name;
+    int fd; // -1 once failed
+#ifdef __linux__
+    int mid[2]; // private pipe the input is duplicated into before it is spliced to `fd`
+    int copy;   // `fd` does not support splice, drain `mid` with read/write instead
+#endif
+};
+
+/**
+ * drops output `out` after a failed write. a reader that went away (EPIPE) is not an error worth printing.
+ */
+static void tee_out_fail(struct rmsh *sh, struct tee_out *out)
+{
+    if (errno != EPIPE)
+        RMSH_SYSERRFMT(sh, "tee: %s", out->name);
+    if (out->fd != STDOUT_FILENO)
+        close(out->fd);
+    out->fd = -1;
+}
+
+/**
+ * copies stdin to every output through one large user-space buffer.
+ * returns exit status.
+ */
+static int builtin_tee_copy(struct rmsh *sh, struct tee_out *outs, size_t nouts)
+{
+    int status = 0;
+    char *buf;
+    ssize_t n;
+
+    if (!(buf = malloc(TEE_BUFSZ))) {
+        RMSH_STRERRMSG(sh, ENOMEM, "tee");
+        return 1;
+    }
+
+    while (0 != (n = read(STDIN_FILENO, buf, TEE_BUFSZ))) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            RMSH_SYSERRMSG(sh, "tee: read error");
+            status = 1;
+            break;
+        }
+
+        for (size_t i = 0; i < nouts; i++) {
+            if (outs[i].fd == -1)
+                continue;
+            if (0 != write_all(outs[i].fd, buf, n)) {
+                tee_out_fail(sh, &outs[i]);
+                status = 1;
+            }
+        }
+    }
+
+    free(buf);
+    return status;
+}
+
+#ifdef __linux__
+/**
+ * moves `n` bytes already sitting in `out->mid` to `out->fd`.
+ * returns 0 on success and -1 on failure.
+ */
+static int tee_drain(struct tee_out *out, size_t n, char **buf)
+{
+    while (n) {
+        ssize_t s;
+
+        if (!out->copy) {
+            s = splice(out->mid[0], NULL, out->fd, NULL, n, SPLICE_F_MOVE);
+            if (s < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                out->copy = 1; // e.g. O_APPEND files or terminals
+                continue;
+            }
+        }
+        else {
+            if (!*buf && !(*buf = malloc(TEE_BUFSZ)))
+                return -1;
+            s = read(out->mid[0], *buf, (n < TEE_BUFSZ ? n : TEE_BUFSZ));
+            if (s > 0 && 0 != write_all(out->fd, *buf, s))
+                return -1;
+        }
+
+        if (s < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        n -= s;
+    }
+    return 0;
+}
+
+/**
+ * duplicates stdin into every output without copying it to user-space:
+ * tee(2) links the pending pipe buffers into a private pipe per output (the last one moves them instead),
+ * and splice(2) moves them from there to the output.
+ * returns exit status, or -1 if stdin is not a pipe and nothing was consumed.
+ */
+static int builtin_tee_zerocopy(struct rmsh *sh, struct tee_out *outs, size_t nouts)
+{
+    int status = -1;
+    struct stat st;
+    char *buf = NULL;
+    int pipesz;
+
+    if (0 != fstat(STDIN_FILENO, &st) || !S_ISFIFO(st.st_mode))
+        return -1;
+
+    if (-1 == (pipesz = fcntl(STDIN_FILENO, F_GETPIPE_SZ)))
+        return -1;
+
+    for (size_t i = 0; i < nouts; i++)
+        outs[i].mid[0] = outs[i].mid[1] = -1;
+
+    // every private pipe must be able to hold the entire input pipe so tee(2) never duplicates partially
+    for (size_t i = 0; i < nouts; i++) {
+        if (outs[i].fd == -1)
+            continue;
+        if (0 != pipe(outs[i].mid))
+            goto out;
+        if (pipesz > fcntl(outs[i].mid[1], F_SETPIPE_SZ, pipesz))
+            goto out;
+    }
+
+    status = 0;
+    while (1) {
+        ssize_t n = 0;
+        ssize_t last = -1;
+
+        for (size_t i = 0; i < nouts; i++)
+            if (outs[i].fd != -1)
+                last = i;
+        if (last == -1)
+            break; // all outputs failed
+
+        for (ssize_t i = 0; i < last; i++) {
+            ssize_t t;
+            if (outs[i].fd == -1)
+                continue;
+
+            // the first duplication decides how much is moved this round
+            while (-1 == (t = tee(STDIN_FILENO, outs[i].mid[1], (n ? n : pipesz), 0)) && errno == EINTR);
+            if (t < 0 || (n && t != n)) {
+                RMSH_SYSERRMSG(sh, "tee: read error");
+                status = 1;
+                goto out;
+            }
+            n = t;
+            if (!n)
+                goto out; // EOF
+        }
+
+        for (ssize_t moved = 0; !n || moved < n; ) {
+            ssize_t s = splice(STDIN_FILENO, NULL, outs[last].mid[1], NULL, (n ? n - moved : pipesz), SPLICE_F_MOVE);
+            if (s < 0) {
+                if (errno == EINTR)
+                    continue;
+                RMSH_SYSERRMSG(sh, "tee: read error");
+                status = 1;
+                goto out;
+            }
+            if (!s)
+                goto out; // EOF
+            if (!n)
+                n = s; // only output
+            moved += s;
+        }
+
+        for (ssize_t i = 0; i <= last; i++) {
+            if (outs[i].fd == -1)
+                continue;
+            if (0 != tee_drain(&outs[i], n, &buf)) {
+                tee_out_fail(sh, &outs[i]);
+                close(outs[i].mid[0]);
+                close(outs[i].mid[1]);
+                outs[i].mid[0] = outs[i].mid[1] = -1;
+                status = 1;
+            }
+        }
+    }
+
+out:
+    for (size_t i = 0; i < nouts; i++) {
+        if (outs[i].mid[0] != -1)
+            close(outs[i].mid[0]);
+        if (outs[i].mid[1] != -1)
+            close(outs[i].mid[1]);
+    }
+    if (buf)
+        free(buf);
+    return status;
+}
+#endif
+
+/**
+ * tee [-a] [FILE]...
+ * copies stdin to stdout and every FILE.
+ */
+static int builtin_tee(struct rmsh *sh, int argc, char **argv)
+{
+    int status = 0;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int argi;
+    struct tee_out *outs;
+    size_t nouts = 0;
+
+    for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+        if (!strcmp(argv[argi], "--")) {
+            argi++;
+            break;
+        }
+        if (!strcmp(argv[argi], "-a")) {
+            flags = (flags & ~O_TRUNC) | O_APPEND;
+            continue;
+        }
+        RMSH_ERRFMT(sh, "tee: %s: invalid option", argv[argi]);
+        RMSH_ERRMSG(sh, "tee: usage: tee [-a] [FILE]...");
+        return 2;
+    }
+
+    if (!(outs = calloc(1 + (argc - argi), sizeof(*outs)))) {
+        RMSH_STRERRMSG(sh, ENOMEM, "tee");
+        return 1;
+    }
+
+    outs[nouts].name = "standard output";
+    outs[nouts++].fd = STDOUT_FILENO;
+
+    for (; argi < argc; argi++) {
+        int fd = open(argv[argi], flags | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            RMSH_SYSERRFMT(sh, "tee: %s", argv[argi]);
+            status = 1;
+            continue;
+        }
+        outs[nouts].name = argv[argi];
+        outs[nouts++].fd = fd;
+    }
+
+    int copy_status = -1;
+#ifdef __linux__
+    copy_status = builtin_tee_zerocopy(sh, outs, nouts);
+#endif
+    if (copy_status == -1)
+        copy_status = builtin_tee_copy(sh, outs, nouts);
+    status |= copy_status;
+
+    for (size_t i = 1; i < nouts; i++)
+        if (outs[i].fd != -1)
+            close(outs[i].fd);
+    free(outs);
+    return status;
+}
+
+#define READ_CHUNK_MIN 4096
+#define READ_CHUNK_MAX (64 * 1024)
+
+/**
+ * input of the read builtin.
+ * regular files are read in chunks and the unconsumed part is given back with lseek(),
+ * anything else (pipes, terminals) is read one byte at a time so we never consume past the delimiter.
+ */
+struct read_input {
+    int fd;
+    int seekable;
+    char  *buf;
+    size_t pos;
+    size_t len;
+    size_t chunk;
+};
+
+/**
+ * returns the next byte, -1 on EOF or -2 on error.
+ */
+static int read_input_next(struct read_input *in)
+{
+    ssize_t n;
+    unsigned char c;
+
+    if (in->pos < in->len)
+        return (unsigned char)in->buf[in->pos++];
+
+    if (!in->seekable) {
+        while (-1 == (n = read(in->fd, &c, 1)) && errno == EINTR);
+        return (n == 1 ? c : (n == 0 ? -1 : -2));
+    }
+
+    // lines longer than a chunk read bigger chunks
+    if (!in->chunk)
+        in->chunk = READ_CHUNK_MIN;
+    else if (in->chunk < READ_CHUNK_MAX)
+        in->chunk *= 2;
+
+    if (!in->buf || in->len < in->chunk) {
+        char *buf = realloc(in->buf, in->chunk);
+        if (!buf)
+            return -2;
+        in->buf = buf;
+    }
 
-    // calculate cursor difference
-    int moves = utf8_strlen(p->prmt_ps1);
-    if (-1 == moves)
-        return -1;
-    moves = ((ssize_t)PRMT_SRCH_TLEN) - moves;
+    while (-1 == (n = read(in->fd, in->buf, in->chunk)) && errno == EINTR);
+    if (n <= 0)
+        return (n == 0 ? -1 : -2);
+    in->pos = 0;
+    in->len = n;
+    return (unsigned char)in->buf[in->pos++];
+}
 
-    __print_redrawline(NULL, p->prmt_srch_line, moves);
-    return 0;
+/**
+ * gives back everything read but not consumed.
+ */
+static void read_input_close(struct read_input *in)
+{
+    if (in->seekable && in->pos < in->len)
+        lseek(in->fd, -(off_t)(in->len - in->pos), SEEK_CUR);
+    if (in->buf)
+        free(in->buf);
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen.
+ * splits the next field of `line` (`n` bytes) by `ifs` starting at `*pos`.
+ * if `rest` is set, the field spans until the end of the line, without trailing IFS whitespace.
+ * bytes marked in `lit` were escaped and never split on.
  */
-static int __prompt_output_next_search(struct prompt *p)
+static char *read_split(const char *line, const char *lit, size_t n, size_t *pos, const char *ifs, int rest)
 {
-    if (!p->prmt_srch_line)
-        return -1; // not in search mode
+#define READ_IFS(I)    (!(lit && lit[I]) && line[I] && strchr(ifs, line[I]))
+#define READ_IFS_WS(I) (READ_IFS(I) && strchr(" \t\n", line[I]))
 
-    size_t prev_row = p->prmt_cur_row;
-    size_t prev_col = p->prmt_cur_col;
-    int moves = 0;
-    if (0 != __prompt_search(p, p->prmt_cur_row + 1, p->prmt_srch_line + PRMT_SRCH_QSTART, p->prmt_srch_query_sz, &moves))
-        return -1; // general failure while searching
-    
-    // not found, do nothing
-    if (moves == 0 && prev_row == p->prmt_cur_row && prev_col == p->prmt_cur_col)
-        return 0;
-    
-    __print_redrawline(NULL, p->prmt_srch_line, moves);
-    return 0;
+    size_t start = *pos;
+    size_t end;
+
+    if (rest) {
+        for (end = n; end > start && READ_IFS_WS(end - 1); end--);
+        *pos = n;
+        return strndup(line + start, end - start);
+    }
+
+    for (end = start; end < n && !READ_IFS(end); end++);
+    *pos = end;
+
+    // a field ends with any IFS whitespace around at most one IFS non-whitespace character
+    for (; *pos < n && READ_IFS_WS(*pos); (*pos)++);
+    if (*pos < n && READ_IFS(*pos)) {
+        for ((*pos)++; *pos < n && READ_IFS_WS(*pos); (*pos)++);
+    }
+
+    return strndup(line + start, end - start);
+
+#undef READ_IFS_WS
+#undef READ_IFS
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * If `out_moves` is NULL, redraws current line.
- * Else, amount of cursor moves is returned via `out_moves`.
- * NOTE: prints to screen.if `out_moves` is NULL.
+ * read [-r] [-d DELIM] [-n NCHARS] [NAME]...
+ * reads a line from stdin and splits it by IFS into every NAME, the last NAME gets the rest of the line.
+ * without NAME, the line is stored in REPLY.
  */
-static int __prompt_output_exit_search(struct prompt *p, int *out_moves)
+static int builtin_read(struct rmsh *sh, int argc, char **argv)
 {
-    if (!p->prmt_srch_line)
-        return 0; // not in search, ignore
+    int status = 1;
+    int raw = 0;
+    int delim = '\n';
+    long nchars = -1;
+    int argi;
+    struct stat st;
+    struct read_input in = {.fd = STDIN_FILENO};
+
+    char  *line = NULL;
+    char  *lit = NULL; // escaped bytes of `line` (not split on), only without -r
+    size_t n = 0;
+    size_t cap = 0;
+    long   count = 0;
+    int    cont = 0; // continuation bytes left for the current character
+    int    escaped = 0;
+    int    c;
+
+    for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+        const char *opt = argv[argi] + 1;
+
+        if (!strcmp(argv[argi], "--")) {
+            argi++;
+            break;
+        }
 
-    // calculate total srch prompt length (not including result)
-    int srch_u8len = utf8_strnlen(p->prmt_srch_line + PRMT_SRCH_QSTART, p->prmt_srch_query_sz);
-    if (-1 == srch_u8len)
-        return -1; // invalid utf8 search query
-    srch_u8len += PRMT_SRCH_TLEN;
+        for (; *opt; opt++) {
+            const char *value;
 
-    // reset search params
-    free(p->prmt_srch_line);
-    p->prmt_srch_line = NULL;
-    p->prmt_srch_line_sz = p->prmt_srch_query_sz = 0;
+            if (*opt == 'r') {
+                raw = 1;
+                continue;
+            }
 
-    // calculate cursor difference
-    int moves = utf8_strlen(p->prmt_ps1);
-    if (-1 == moves)
-        return -1;
-    moves -= srch_u8len;
+            if (*opt != 'd' && *opt != 'n') {
+                RMSH_ERRFMT(sh, "read: -%c: invalid option", *opt);
+                goto usage;
+            }
 
-    if (out_moves)
-        *out_moves += moves;
-    else
-        __print_redrawline(p->prmt_ps1, (prompt_get(p) ?: ""), moves);
-    return 0;
+            // option value is either the rest of this word or the next one
+            value = (opt[1] ? opt + 1 : argv[++argi]);
+            if (!value) {
+                RMSH_ERRFMT(sh, "read: -%c: option requires an argument", *opt);
+                goto usage;
+            }
+
+            if (*opt == 'd') {
+                delim = (unsigned char)value[0];
+            }
+            else {
+                char *end;
+                nchars = strtol(value, &end, 10);
+                if (*end || nchars < 0) {
+                    RMSH_ERRFMT(sh, "read: %s: invalid number", value);
+                    return 2;
+                }
+            }
+            break;
+        }
+    }
+
+    for (int i = argi; i < argc; i++) {
+        const char *name = argv[i];
+        size_t len;
+        for (len = 0; name[len] && lex_isname(name[len], len == 0); len++);
+        if (!len || name[len]) {
+            RMSH_ERRFMT(sh, "read: `%s': not a valid identifier", name);
+            return 1;
+        }
+    }
+
+    in.seekable = (0 == fstat(in.fd, &st) && S_ISREG(st.st_mode));
+
+    while (nchars == -1 || count < nchars || cont) {
+        int literal = 0;
+
+        if ((c = read_input_next(&in)) < 0) {
+            if (c == -2)
+                RMSH_SYSERRMSG(sh, "read: read error");
+            break; // EOF before the delimiter fails, but still assigns what was read
+        }
+
+        if (escaped) {
+            escaped = 0;
+            if (c == '\n')
+                continue; // line continuation
+            literal = 1;
+        }
+        else if (!raw && c == '\\') {
+            escaped = 1;
+            continue;
+        }
+        else if (c == delim) {
+            status = 0;
+            break;
+        }
+
+        if (n + 1 >= cap) {
+            cap = (cap ? cap * 2 : 128);
+            if (!(line = realloc(line, cap)) || (!raw && !(lit = realloc(lit, cap)))) {
+                RMSH_STRERRMSG(sh, ENOMEM, "read");
+                status = 2;
+                goto out;
+            }
+        }
+        if (lit)
+            lit[n] = literal;
+        line[n++] = c;
+
+        // -n counts characters, not bytes
+        if (cont)
+            cont--;
+        else {
+            count++;
+            if ((cont = utf8_size(c) - 1) < 0)
+                cont = 0;
+        }
+    }
+    if (nchars != -1 && count >= nchars && !cont)
+        status = 0;
+
+    if (line)
+        line[n] = 0;
+
+    if (argi == argc) {
+        // REPLY is not split
+        if (0 != rmsh_var_set(sh, "REPLY", (line ?: "")))
+            status = 2;
+    }
+    else {
+        const char *ifs = (rmsh_var_get(sh, "IFS") ?: IFS);
+        size_t pos = 0;
+
+        // leading IFS whitespace is never part of a field
+        while (pos < n && !(lit && lit[pos]) && strchr(" \t\n", line[pos]) && strchr(ifs, line[pos]))
+            pos++;
+
+        for (; argi < argc; argi++) {
+            char *value = read_split((line ?: ""), lit, n, &pos, ifs, (argi + 1 == argc));
+            if (!value || 0 != rmsh_var_set(sh, argv[argi], value)) {
+                RMSH_STRERRMSG(sh, ENOMEM, "read");
+                status = 2;
+            }
+            free(value);
+        }
+    }
+
+out:
+    read_input_close(&in);
+    free(line);
+    free(lit);
+    return status;
+
+usage:
+    RMSH_ERRMSG(sh, "read: usage: read [-r] [-d delim] [-n nchars] [name ...]");
+    return 2;
 }
 
+#define MAPFILE_CHUNK (64 * 1024)
+
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen.
+ * reads stdin to the end in large chunks into `*out_buf`, or up to `nlines` lines
+ * one byte at a time so nothing past them is consumed.
+ * returns 0 on success and -1 on failure.
  */
-static int __prompt_output_backspace_search(struct prompt *p)
+static int mapfile_read(int fd, int delim, size_t nlines, char **out_buf, size_t *out_len)
 {
-    if (!p->prmt_srch_line)
-        return -1; // not in search
-    
-    if (!p->prmt_srch_query_sz)
-        return 0; // no search, ignore
+    char  *buf = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    ssize_t n;
 
-    int del = utf8_rsize((unsigned char *)(p->prmt_srch_line + PRMT_SRCH_QSTART), p->prmt_srch_query_sz);
-    if (!del)
-        return -1; // invalid utf8 length
-    
-    memmove(p->prmt_srch_line + PRMT_SRCH_QSTART + p->prmt_srch_query_sz - del,
-            p->prmt_srch_line + PRMT_SRCH_QSTART + p->prmt_srch_query_sz,
-            p->prmt_srch_line_sz - (PRMT_SRCH_QSTART + p->prmt_srch_query_sz) + 1); // +1 for \0
-    p->prmt_srch_line_sz -= del;
-    p->prmt_srch_query_sz -= del;
+    while (1) {
+        size_t want = (nlines ? 1 : MAPFILE_CHUNK);
+
+        if (len + want > cap) {
+            char *newbuf;
+            cap = (cap ? cap * 2 : MAPFILE_CHUNK);
+            if (!(newbuf = realloc(buf, cap))) {
+                free(buf);
+                return -1;
+            }
+            buf = newbuf;
+        }
+
+        if (0 > (n = read(fd, buf + len, (nlines ? 1 : cap - len)))) {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            return -1;
+        }
+        if (!n)
+            break;
+        len += n;
+
+        if (nlines && buf[len - 1] == delim && !--nlines)
+            break;
+    }
 
-    __print_redrawline(NULL, p->prmt_srch_line, -1);
+    *out_buf = buf;
+    *out_len = len;
     return 0;
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen.
+ * mapfile [-t] [-d DELIM] [-n COUNT] [-s COUNT] [ARRAY]
+ * loads the lines of stdin into ARRAY (MAPFILE by default) in one pass.
+ * regular files are mapped and anything else is read in large chunks, lines are found with memchr()
+ * and copied into a single arena which the array elements point into.
  */
-static int __prompt_output_backspace_line(struct prompt *p)
+static int builtin_mapfile(struct rmsh *sh, int argc, char **argv)
 {
-    if (!p->prmt_cur_col)
-        return 0; // nothing to delete
-    
-    // if the current line is null and it isn't the initial line,
-    // it means we're on a history line, we want to copy it to the prompt lines
-    // because we never want to modify history.
-    const char *hist_line;
-    char *curr_line = p->prmt_line[p->prmt_cur_row];
-    if (!curr_line && p->prmt_cur_row && (hist_line = history_get(p->prmt_cur_row - 1))) // `-1` because prmt_line is `1+HIST_MAX`
-        if (!(curr_line = p->prmt_line[p->prmt_cur_row] = strdup(hist_line)))
-            return -1;
+    int status = 1;
+    int trim = 0;
+    int delim = '\n';
+    size_t count = 0;
+    size_t skip = 0;
+    const char *name = "MAPFILE";
+    int argi;
+    struct stat st;
 
-    int del = utf8_rsize((unsigned char *)curr_line, p->prmt_cur_col);
-    if (!del)
-        return -1; // invalid utf8 length
-    
-    if (del > p->prmt_cur_col)
-        del = p->prmt_cur_col;
-    
-    memmove(curr_line + p->prmt_cur_col - del, curr_line + p->prmt_cur_col, strlen(curr_line) - p->prmt_cur_col + 1); // +1 for \0
-    p->prmt_cur_col -= del;
+    char  *src = NULL; // input, either mapped or read
+    size_t src_len = 0;
+    void  *map = MAP_FAILED;
+    size_t map_len = 0;
+    off_t  off = 0;
 
-    __print_redrawcursor(curr_line + p->prmt_cur_col, -1, 0);
-    return 0;
+    size_t nvalues = 0;
+    size_t consumed = 0;
+    char **values = NULL;
+    char  *arena = NULL;
+
+    for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+        const char *opt = argv[argi] + 1;
+
+        if (!strcmp(argv[argi], "--")) {
+            argi++;
+            break;
+        }
+
+        for (; *opt; opt++) {
+            const char *value;
+
+            if (*opt == 't') {
+                trim = 1;
+                continue;
+            }
+
+            if (*opt != 'd' && *opt != 'n' && *opt != 's') {
+                RMSH_ERRFMT(sh, "%s: -%c: invalid option", argv[0], *opt);
+                goto usage;
+            }
+
+            // option value is either the rest of this word or the next one
+            value = (opt[1] ? opt + 1 : argv[++argi]);
+            if (!value) {
+                RMSH_ERRFMT(sh, "%s: -%c: option requires an argument", argv[0], *opt);
+                goto usage;
+            }
+
+            if (*opt == 'd') {
+                delim = (unsigned char)value[0];
+            }
+            else {
+                char *end;
+                long num = strtol(value, &end, 10);
+                if (*end || num < 0) {
+                    RMSH_ERRFMT(sh, "%s: %s: invalid number", argv[0], value);
+                    return 2;
+                }
+                *(*opt == 'n' ? &count : &skip) = num;
+            }
+            break;
+        }
+    }
+
+    if (argi < argc) {
+        size_t len;
+        name = argv[argi++];
+        for (len = 0; name[len] && lex_isname(name[len], len == 0); len++);
+        if (!len || name[len] || argi < argc) {
+            RMSH_ERRFMT(sh, "%s: `%s': not a valid identifier", argv[0], name);
+            return 1;
+        }
+    }
+
+    if (0 == fstat(STDIN_FILENO, &st) && S_ISREG(st.st_mode) && -1 != (off = lseek(STDIN_FILENO, 0, SEEK_CUR))) {
+        // map from the current offset, which may not be page aligned
+        off_t map_off = off & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        if (st.st_size > off) {
+            map_len = st.st_size - map_off;
+            if (MAP_FAILED == (map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, STDIN_FILENO, map_off))) {
+                RMSH_SYSERRFMT(sh, "%s: mmap", argv[0]);
+                goto out;
+            }
+            src = (char *)map + (off - map_off);
+            src_len = st.st_size - off;
+        }
+    }
+    else if (0 != mapfile_read(STDIN_FILENO, delim, (count ? skip + count : 0), &src, &src_len)) {
+        RMSH_SYSERRFMT(sh, "%s: read error", argv[0]);
+        goto out;
+    }
+
+    // first pass: find the lines to keep, so the array and the arena are allocated once
+    const char *first = NULL;
+    const char *curr = src;
+    const char *end = src + src_len;
+    for (size_t line = 0; curr < end && (!count || nvalues < count); line++) {
+        const char *nl = memchr(curr, delim, end - curr);
+        if (line == skip)
+            first = curr;
+        if (line >= skip)
+            nvalues++;
+        curr = (nl ? nl + 1 : end);
+    }
+    if (!first)
+        first = curr;
+    consumed = curr - src;
+
+    if (!(values = malloc((nvalues ?: 1) * sizeof(char *))) ||
+        !(arena = malloc((curr - first) + nvalues + 1))) { // +1 per line for \0
+        RMSH_STRERRMSG(sh, ENOMEM, argv[0]);
+        goto out;
+    }
+
+    // second pass: copy the kept lines into the arena
+    char *dst = arena;
+    end = curr;
+    curr = first;
+    for (size_t i = 0; i < nvalues; i++) {
+        const char *nl = memchr(curr, delim, end - curr);
+        size_t len = (nl ? (size_t)(nl - curr) + 1 : (size_t)(end - curr));
+        size_t keep = (nl && trim ? len - 1 : len);
+
+        memcpy(dst, curr, keep);
+        dst[keep] = 0;
+        values[i] = dst;
+        dst += keep + 1;
+        curr += len;
+    }
+
+    if (0 != rmsh_var_set_array(sh, name, values, nvalues, arena)) {
+        values = NULL;
+        arena = NULL;
+        RMSH_STRERRMSG(sh, ENOMEM, argv[0]);
+        goto out;
+    }
+    values = NULL;
+    arena = NULL;
+
+    // give back what was not loaded
+    if (map != MAP_FAILED)
+        lseek(STDIN_FILENO, off + consumed, SEEK_SET);
+
+    status = 0;
+out:
+    if (values)
+        free(values);
+    if (arena)
+        free(arena);
+    if (map != MAP_FAILED)
+        munmap(map, map_len);
+    else if (src)
+        free(src);
+    return status;
+
+usage:
+    RMSH_ERRFMT(sh, "%s: usage: %s [-t] [-d delim] [-n count] [-s count] [array]", argv[0], argv[0]);
+    return 2;
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen if `out_moves` is NULL
+ * prints the counters of the interactive prompt and the features of the terminal,
+ * `-l` lists the latency histogram (us) and `-r` resets the counters afterwards.
  */
-static int __prompt_output_del(struct prompt *p, int *out_moves)
+static int builtin_promptstat(struct rmsh *sh, int argc, char **argv)
 {
-    const char *curr_line_const = prompt_get(p);
-    size_t n = (curr_line_const ? strlen(curr_line_const) : 0);
+    int reset = 0, buckets = 0;
+    int argi;
 
-    if (p->prmt_cur_col >= n)
-        return 0; // nothing to delete
-    
-    // if the current line is null and it isn't the initial line,
-    // it means we're on a history line, we want to copy it to the prompt lines
-    // because we never want to modify history.
-    const char *hist_line;
-    char *curr_line = p->prmt_line[p->prmt_cur_row];
-    if (!curr_line && p->prmt_cur_row && (hist_line = history_get(p->prmt_cur_row - 1))) // `-1` because prmt_line is `1+HIST_MAX`
-        if (!(curr_line = p->prmt_line[p->prmt_cur_row] = strdup(hist_line)))
-            return -1;
+    for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+        if (!strcmp(argv[argi], "--")) {
+            argi++;
+            break;
+        }
+        if (!strcmp(argv[argi], "-r")) {
+            reset = 1;
+            continue;
+        }
+        if (!strcmp(argv[argi], "-l")) {
+            buckets = 1;
+            continue;
+        }
+        RMSH_ERRFMT(sh, "promptstat: %s: invalid option", argv[argi]);
+        RMSH_ERRMSG(sh, "promptstat: usage: promptstat [-l] [-r]");
+        return 2;
+    }
+    if (argi < argc) {
+        RMSH_ERRMSG(sh, "promptstat: usage: promptstat [-l] [-r]");
+        return 2;
+    }
 
-    int del = utf8_size(curr_line[p->prmt_cur_col]);
-    if (!del)
-        return -1; // invalid utf8 length
-    
-    if (del > (n - p->prmt_cur_col))
-        del = n - p->prmt_cur_col;
-    
-    memmove(curr_line + p->prmt_cur_col, curr_line + p->prmt_cur_col + del, strlen(curr_line) - p->prmt_cur_col + 1); // +1 for \0
+    prompt_stat_print(STDOUT_FILENO, buckets);
+    for (size_t i = 0; i < PRMT_TERM_FIELDS; i++)
+        dprintf(STDOUT_FILENO, "%-12s%d\n", prompt_term_fields[i].name, *prompt_term_field(&prompt_term, i));
 
-    if (!out_moves)
-        __print_redrawcursor(curr_line + p->prmt_cur_col, 0, 0);
+    if (reset)
+        memset(&prompt_stat, 0, sizeof(prompt_stat));
     return 0;
 }
 
+static int builtin_bind_cmp(const void *a, const void *b)
+{
+    return strcmp((*(const struct prompt_keymap_ent **)a)->seq, (*(const struct prompt_keymap_ent **)b)->seq);
+}
+
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen if `out_moves` is NULL.
+ * bind [-l] [-r KEYSEQ] [KEYSEQ FUNCTION]
+ * binds KEYSEQ to FUNCTION, or unbinds it with `-r`. `-l` lists the functions,
+ * and without arguments the bindings are listed as commands that recreate them.
  */
-static int __prompt_output_cursor_backward(struct prompt *p, int *out_moves)
+static int builtin_bind(struct rmsh *sh, int argc, char **argv)
 {
-    if (!p->prmt_cur_col)
-        return 0; // nothing to delete
-    
-    const char *curr_line = prompt_get(p);
-    int cnt = utf8_rsize((const unsigned char *)curr_line, p->prmt_cur_col);
-    if (!cnt)
-        return -1; // invalid utf8 length
-    
-    if (p->prmt_cur_col < cnt)
-        cnt = p->prmt_cur_col;
-    
-    p->prmt_cur_col -= cnt;
+    int list_fns = 0, unbind = 0;
+    int argi, ret;
+    size_t fn = 0;
 
-    if (out_moves)
-        *out_moves -= 1;
-    else
-        __print_movecursor(-1);
+    for (argi = 1; argi < argc && argv[argi][0] == '-' && argv[argi][1]; argi++) {
+        if (!strcmp(argv[argi], "--")) {
+            argi++;
+            break;
+        }
+        if (!strcmp(argv[argi], "-l")) {
+            list_fns = 1;
+            continue;
+        }
+        if (!strcmp(argv[argi], "-r")) {
+            unbind = 1;
+            continue;
+        }
+        RMSH_ERRFMT(sh, "bind: %s: invalid option", argv[argi]);
+        goto usage;
+    }
+
+    if (0 != prompt_keymap_init()) {
+        RMSH_SYSERR(sh);
+        return 1;
+    }
+
+    if (list_fns) {
+        if (argi < argc || unbind)
+            goto usage;
+        for (size_t i = 1; i < PRMT_FN_CNT; i++)
+            dprintf(STDOUT_FILENO, "%s\n", prompt_fns[i].name);
+        return 0;
+    }
+
+    if (argi == argc && !unbind) {
+        struct prompt_keymap *km = &prompt_keymap;
+        struct prompt_keymap_ent **ents = malloc(km->n * sizeof(*ents));
+        size_t n = 0;
+        if (!ents) {
+            RMSH_SYSERR(sh);
+            return 1;
+        }
+        for (size_t i = 0; i < km->cap; i++)
+            if (km->ent[i].key && km->ent[i].fn)
+                ents[n++] = &km->ent[i];
+        qsort(ents, n, sizeof(*ents), builtin_bind_cmp);
+        for (size_t i = 0; i < n; i++)
+            dprintf(STDOUT_FILENO, "bind '%s' %s\n", ents[i]->seq, prompt_fns[ents[i]->fn].name);
+        free(ents);
+        return 0;
+    }
+
+    if (argc - argi != (unbind ? 1 : 2))
+        goto usage;
+
+    if (!unbind && !(fn = prompt_fn_find(argv[argi + 1]))) {
+        RMSH_ERRFMT(sh, "bind: %s: unknown function", argv[argi + 1]);
+        return 1;
+    }
+
+    if (-2 == (ret = prompt_keymap_bind(argv[argi], fn))) {
+        RMSH_ERRFMT(sh, "bind: %s: invalid key sequence", argv[argi]);
+        return 1;
+    }
+    if (-3 == ret) {
+        RMSH_ERRFMT(sh, "bind: %s: starts with a key that inserts text", argv[argi]);
+        return 1;
+    }
+    if (ret) {
+        RMSH_SYSERR(sh);
+        return 1;
+    }
     return 0;
+
+usage:
+    RMSH_ERRMSG(sh, "bind: usage: bind [-l] [-r KEYSEQ] [KEYSEQ FUNCTION]");
+    return 2;
+}
+
+static const struct rmsh_builtin rmsh_builtins[] = {
+    {"bind", builtin_bind},
+    {"mapfile", builtin_mapfile},
+    {"promptstat", builtin_promptstat},
+    {"read", builtin_read},
+    {"readarray", builtin_mapfile},
+    {"tee", builtin_tee},
+};
+
+static const struct rmsh_builtin *rmsh_find_builtin(const char *name)
+{
+    for (size_t i = 0; i < sizeof(rmsh_builtins) / sizeof(*rmsh_builtins); i++)
+        if (!strcmp(rmsh_builtins[i].name, name))
+            return &rmsh_builtins[i];
+    return NULL;
+}
+
+struct rmsh_proc {
+    struct rmsh_proc *next;
+    struct lex_proc *lex;
+    char *filename;
+    const struct rmsh_builtin *builtin;
+    pid_t pid;    // 0 if the process ran inside the shell or was not found
+    int   status; // exit status when `pid` is 0
+
+    // process substitutions, parallel to `lex->substs`
+    pid_t *subst_pids;
+    int   *subst_fds; // our end of the pipe, closed once the process is launched
+};
+
+static void rmsh_proc_close_substs(struct rmsh_proc *p) {
+    if (!p->subst_fds)
+        return;
+    for (size_t i = 0; i < p->lex->nsubsts; i++) {
+        if (p->subst_fds[i] != -1)
+            close(p->subst_fds[i]);
+        p->subst_fds[i] = -1;
+    }
+}
+
+static void free_rmsh_proc(struct rmsh_proc *p) {
+    rmsh_proc_close_substs(p);
+    if (p->subst_fds)
+        free(p->subst_fds);
+    if (p->subst_pids)
+        free(p->subst_pids);
+    if (p->filename)
+        free(p->filename);
+    if (p->lex)
+        free_lex_proc(p->lex);
+    free(p);
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen if `out_moves` is NULL.
+ * puts process `pid` (0 for the calling one) in the process group of the job being launched,
+ * which starts with its first process. called from both sides of the fork, so it's in place whichever runs first.
+ */
+static void rmsh_join_job(struct rmsh *sh, pid_t pid)
+{
+    if (!sh->tty)
+        return;
+    setpgid(pid, sh->job_pgid);
+    if (pid && !sh->job_pgid)
+        sh->job_pgid = pid;
+    if (!pid)
+        sh->tty = NULL; // a subshell doesn't own the terminal
+}
+
+/**
+ * forks a process with `in_fd` and `out_fd` as its stdin and stdout.
+ * in an interactive shell it joins the process group of the job.
+ * returns pid (0 in the child) or -1 on error.
  */
-static int __prompt_output_cursor_forward(struct prompt *p, int *out_moves)
+static pid_t rmsh_fork(struct rmsh *sh, int in_fd, int out_fd)
 {
-    const char *curr_line = prompt_get(p);
-    size_t curr_line_sz = (curr_line ? strlen(curr_line) : 0);
+    pid_t pid;
 
-    if (p->prmt_cur_col >= curr_line_sz)
-        return 0; // nothing to delete
-    
-    int cnt = utf8_size(curr_line[p->prmt_cur_col]);
-    if (cnt == 0 || cnt == -1)
+    fflush(NULL);
+    if (-1 == (pid = fork())) {
+        fprintf(stderr, "%s: %s\n", sh->shname, strerror(errno));
         return -1;
-    
-    if ((p->prmt_cur_col + cnt) > curr_line_sz)
-        cnt = curr_line_sz - p->prmt_cur_col;
+    }
 
-    p->prmt_cur_col += cnt;
+    rmsh_join_job(sh, pid);
 
-    if (out_moves)
-        *out_moves += 1;
-    else
-        __print_movecursor(1);
-    return 0;
+    if (0 == pid) {
+        if ((in_fd != STDIN_FILENO && -1 == dup2(in_fd, STDIN_FILENO)) ||
+            (out_fd != STDOUT_FILENO && -1 == dup2(out_fd, STDOUT_FILENO))) {
+            fprintf(stderr, "%s: %s\n", sh->shname, strerror(errno));
+            exit(1);
+        }
+    }
+
+    return pid;
+}
+
+static int argc_of(char **argv)
+{
+    int argc = 0;
+    while (argv[argc])
+        argc++;
+    return argc;
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen if `out_moves` is NULL.
+ * opens the redirections of `lexp` over their fds.
+ * if `saved` is not NULL, every replaced fd is first saved there (-1 if it was closed)
+ * so rmsh_restore_redirs() can put it back, entries which were not applied are left as -2.
+ * returns 0 on success and -1 on failure.
  */
-static int __prompt_output_cursor_home(struct prompt *p, int *out_moves)
+static int rmsh_apply_redirs(struct rmsh *sh, struct lex_proc *lexp, int *saved)
 {
-    int ret;
-    int moves = 0;
+    for (size_t i = 0; i < lexp->nredirs; i++) {
+        struct lex_redir *r = &lexp->redirs[i];
+        int flags = O_CLOEXEC;
+        int fd;
 
-    while (p->prmt_cur_col)
-        if ((ret = __prompt_output_cursor_backward(p, &moves)))
-            return ret;
+        if (r->type == LEX_REDIR_IN)
+            flags |= O_RDONLY;
+        else
+            flags |= O_WRONLY | O_CREAT | (r->type == LEX_REDIR_APPEND ? O_APPEND : O_TRUNC);
 
-    if (out_moves)
-        *out_moves += moves;
-    else
-        __print_movecursor(moves);
+        if (-1 == (fd = open(r->path, flags, 0666))) {
+            RMSH_SYSERRFMT(sh, "%s", r->path);
+            return -1;
+        }
+
+        if (saved)
+            saved[i] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+
+        if (fd == r->fd) {
+            fcntl(fd, F_SETFD, 0);
+            continue;
+        }
+
+        if (-1 == dup2(fd, r->fd)) {
+            RMSH_SYSERRFMT(sh, "%s", r->path);
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
     return 0;
 }
 
-/**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen if `out_moves` is NULL.
- */
-static int __prompt_output_cursor_end(struct prompt *p, int *out_moves)
+static void rmsh_restore_redirs(struct lex_proc *lexp, int *saved)
 {
-    int ret;
-    int moves = 0;
-    const char *curr_line = prompt_get(p);
-    size_t curr_line_sz = (curr_line ? strlen(curr_line) : 0);
+    fflush(stdout);
 
-    while (p->prmt_cur_col < curr_line_sz)
-        if ((ret = __prompt_output_cursor_forward(p, &moves)))
-            return ret;
-    if (out_moves)
-        *out_moves += moves;
-    else
-        __print_movecursor(moves);
-    return 0;
+    for (size_t i = lexp->nredirs; i-- > 0; ) {
+        if (saved[i] == -2)
+            continue;
+        if (saved[i] == -1) {
+            close(lexp->redirs[i].fd);
+            continue;
+        }
+        dup2(saved[i], lexp->redirs[i].fd);
+        close(saved[i]);
+    }
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen.
+ * runs the builtin of `p` inside the shell, with its redirections and assignments
+ * applied only for the duration of the builtin.
+ * SIGPIPE is ignored meanwhile, a reader going away fails the write (EPIPE) instead of killing the shell.
+ * returns exit status.
  */
-static int __prompt_output_history_up(struct prompt *p)
+static int rmsh_run_builtin(struct rmsh *sh, struct rmsh_proc *p)
 {
-    int ignored;
-    int ret;
+    int status = 1;
+    struct lex_proc *lexp = p->lex;
+    int *saved = NULL;
+    char **oldvalues = NULL;
+    size_t nassigned = 0;
+    struct sigaction ign = {.sa_handler = SIG_IGN}, oldpipe;
+
+    if ((lexp->nredirs && !(saved = malloc(lexp->nredirs * sizeof(int)))) ||
+        (lexp->nassigns && !(oldvalues = calloc(lexp->nassigns, sizeof(char *))))) {
+        RMSH_STRERR(sh, ENOMEM);
+        goto out;
+    }
+    for (size_t i = 0; i < lexp->nredirs; i++)
+        saved[i] = -2;
 
-    if (p->prmt_cur_row + 1 >= HIST_MAX + 1) // out-of-bounds
-        return 0;
-    
-    if (!history_get(p->prmt_cur_row)) // top of history (no +1, history is HIST_MAX, prmt_lines is 1+HIST_MAX)
-        return 0;
+    if (0 != rmsh_apply_redirs(sh, lexp, saved))
+        goto out;
 
-    // exit search if in search
-    if (p->prmt_srch_line && (ret = __prompt_output_exit_search(p, &ignored)))
-        return ret;
+    for (; nassigned < lexp->nassigns; nassigned++) {
+        const char *assign = lexp->assigns[nassigned];
+        const char *eq = strchr(assign, '=');
+        char *name = strndup(assign, eq - assign);
+        const char *old = (name ? rmsh_var_get(sh, name) : NULL);
+        
+        if (!name || (old && !(oldvalues[nassigned] = strdup(old))) || 0 != rmsh_var_set(sh, name, eq + 1)) {
+            free(name);
+            RMSH_STRERR(sh, ENOMEM);
+            goto out;
+        }
+        free(name);
+    }
 
-    p->prmt_cur_row++;
-    const char *curr_line = prompt_get(p);
-    p->prmt_cur_col = (curr_line ? strlen(curr_line) : 0);
-    __print_redrawline_eol(p->prmt_ps1, curr_line);
-    return 0;
+    sigaction(SIGPIPE, &ign, &oldpipe);
+    status = p->builtin->fn(sh, argc_of(lexp->argv), lexp->argv);
+    fflush(stdout);
+    sigaction(SIGPIPE, &oldpipe, NULL);
+out:
+    // restore in reverse, `A=1 A=2 builtin` must end up with the value from before
+    while (nassigned-- > 0) {
+        const char *assign = lexp->assigns[nassigned];
+        char *name = strndup(assign, strchr(assign, '=') - assign);
+        if (name)
+            rmsh_var_set(sh, name, oldvalues[nassigned]);
+        free(name);
+        free(oldvalues[nassigned]);
+    }
+    if (oldvalues)
+        free(oldvalues);
+    if (saved) {
+        rmsh_restore_redirs(lexp, saved);
+        free(saved);
+    }
+    fflush(stdout);
+    return status;
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen.
+ * runs a process made only of assignments and redirections.
+ * returns exit status.
  */
-static int __prompt_output_history_down(struct prompt *p)
+static int rmsh_run_null(struct rmsh *sh, struct lex_proc *lexp)
 {
-    int ignored;
-    int ret;
+    int status = 0;
+    int *saved = NULL;
 
-    if (!p->prmt_cur_row)
-        return 0;
+    if (lexp->nredirs) {
+        if (!(saved = malloc(lexp->nredirs * sizeof(int)))) {
+            RMSH_STRERR(sh, ENOMEM);
+            return 1;
+        }
+        for (size_t i = 0; i < lexp->nredirs; i++)
+            saved[i] = -2;
+        if (0 != rmsh_apply_redirs(sh, lexp, saved))
+            status = 1;
+        rmsh_restore_redirs(lexp, saved);
+        free(saved);
+    }
 
-    // exit search if in search
-    if (p->prmt_srch_line && (ret = __prompt_output_exit_search(p, &ignored)))
-        return ret;
+    for (size_t i = 0; !status && i < lexp->nassigns; i++) {
+        if (0 != rmsh_var_assign(sh, lexp->assigns[i])) {
+            RMSH_STRERR(sh, ENOMEM);
+            status = 1;
+        }
+    }
 
-    p->prmt_cur_row--;
-    const char *curr_line = prompt_get(p);
-    p->prmt_cur_col = (curr_line ? strlen(curr_line) : 0);
-    __print_redrawline_eol(p->prmt_ps1, curr_line);
-    return 0;
+    return status;
 }
 
 /**
- * returns 0 on success and non-zero on failure
- * NOTE: prints to screen.
+ * returns pid or -1 on error;
  */
-static int __prompt_output_clear(struct prompt *p)
+static pid_t rmsh_exec(struct rmsh *sh, const char *filename, struct lex_proc *lexp, int in_fd, int out_fd)
 {
-    int moves = 0;
-    int ret;
+    pid_t ret = -1;
+    pid_t pid;
 
-    // exit search if in search
-    if (p->prmt_srch_line && (ret = __prompt_output_exit_search(p, &moves)))
-        return ret;
+    if (-1 == (pid = rmsh_fork(sh, in_fd, out_fd)))
+        goto out;
 
-    if (moves > 0)
-        printf(VT_CURFWD_N VT_CURSTR VT_SCRCLR VT_CURSET_R_C "%s%s" VT_CURLDR VT_CURSET_R, moves, 1, 1, p->prmt_ps1, (prompt_get(p) ?: ""), 1);
-    else if (moves < 0)
-        printf(VT_CURBCK_N VT_CURSTR VT_SCRCLR VT_CURSET_R_C "%s%s" VT_CURLDR VT_CURSET_R, -moves, 1, 1, p->prmt_ps1, (prompt_get(p) ?: ""), 1);
-    else
-        printf(VT_CURSTR VT_SCRCLR VT_CURSET_R_C "%s%s" VT_CURLDR VT_CURSET_R, 1, 1, p->prmt_ps1, (prompt_get(p) ?: ""), 1);
-    return 0;
-}
+    if (0 == pid) {
+        if (0 != rmsh_apply_redirs(sh, lexp, NULL))
+            exit(1);
 
-static const char *__prompt_output(struct prompt *p, struct __termchar *input)
-{
-    int ret;
-    if (input->tch_type == TCHTYPE_TEXT) {
-        ret = (p->prmt_srch_line ? __prompt_output_search : __prompt_output_line)(p, input->tch_text.data, input->tch_text.sz);
-        return ret ? PRMT_ABRT : NULL;
+        // leading assignments are only in the environment of the program
+        for (size_t i = 0; i < lexp->nassigns; i++) {
+            const char *eq = strchr(lexp->assigns[i], '=');
+            char *name = strndup(lexp->assigns[i], eq - lexp->assigns[i]);
+            if (!name || 0 != setenv(name, eq + 1, 1)) {
+                RMSH_SYSERR(sh);
+                exit(1);
+            }
+            free(name);
+        }
+
+        execv(filename, lexp->argv);
+        fprintf(stderr, "%s: %s: %s\n", sh->shname, filename, strerror(errno));
+        exit(1);
     }
 
-    if (input->tch_type != TCHTYPE_CTRL)
-        return PRMT_ABRT;
-    
-    // input->tch_type == TCHTYPE_CTRL
+    ret = pid;
+out:
+    return ret;
+}
 
-    if (input->tch_ctrl.value == TCHCTRL_EXIT) {
-        ECHO_CNTRL(CTRL_D);
-        putchar('\n');
-        return PRMT_EXIT;
-    }
-    
-    if (input->tch_ctrl.value == TCHCTRL_ENTER) {
-        putchar('\n');
-        return (prompt_get(p) ?: ""); // can't return null because we want to reprint ps1
-    }
-    
-    if (input->tch_ctrl.value == TCHCTRL_LINEKILL) {
-        ECHO_CNTRL(CTRL_C);
-        putchar('\n');
-        return "";
+/**
+ * creates a pipe which is not inherited by executed programs.
+ */
+static int rmsh_pipe(struct rmsh *sh, int fds[2])
+{
+    if (0 != pipe(fds)) {
+        RMSH_SYSERR(sh);
+        return -1;
     }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
 
-    if (input->tch_ctrl.value == TCHCTRL_SEARCH) {
-        ret = (p->prmt_srch_line ? __prompt_output_next_search : __prompt_output_enter_search)(p);
-        return ret ? PRMT_ABRT : NULL;
-    }
+static int rmsh_input(struct rmsh *sh, const char *input);
 
-    if (input->tch_ctrl.value == TCHCTRL_TAB) {
-        if (p->prmt_srch_line)
-            return __prompt_output_exit_search(p, NULL) ? PRMT_ABRT : NULL;
-        return NULL;
-    }
+/**
+ * launches the list of every process substitution of `p` with its stdout (`<(list)`)
+ * or stdin (`>(list)`) connected to a pipe, and replaces the matching argument
+ * with the `/dev/fd/N` path of our end of the pipe.
+ * the pipes are fed concurrently, so no temporary files are written.
+ */
+static int rmsh_launch_substs(struct rmsh *sh, struct rmsh_proc *p)
+{
+    int ret = -1;
+    struct lex_proc *lexp = p->lex;
 
-    if (input->tch_ctrl.value == TCHCTRL_BACKSPACE) {
-        ret = (p->prmt_srch_line ? __prompt_output_backspace_search : __prompt_output_backspace_line)(p);
-        return ret ? PRMT_ABRT : NULL;
+    if (!lexp->nsubsts)
+        return 0;
+
+    if (!(p->subst_pids = calloc(lexp->nsubsts, sizeof(pid_t))) ||
+        !(p->subst_fds = malloc(lexp->nsubsts * sizeof(int)))) {
+        RMSH_STRERR(sh, ENOMEM);
+        goto out;
     }
+    for (size_t i = 0; i < lexp->nsubsts; i++)
+        p->subst_fds[i] = -1;
+
+    for (size_t i = 0; i < lexp->nsubsts; i++) {
+        struct lex_subst *subst = &lexp->substs[i];
+        int fds[2];
+        int ours, theirs;
+        char *path;
+        pid_t pid;
+
+        if (0 != pipe(fds)) {
+            RMSH_SYSERR(sh);
+            goto out;
+        }
 
-    if (input->tch_ctrl.value == TCHCTRL_UP)
-        return __prompt_output_history_up(p) ? PRMT_ABRT : NULL;
-    if (input->tch_ctrl.value == TCHCTRL_DN)
-        return __prompt_output_history_down(p) ? PRMT_ABRT : NULL;
+        // `<(list)` writes into the pipe and we read from it, `>(list)` is the other way around
+        ours   = (subst->dir == LEX_SUBST_READ ? fds[0] : fds[1]);
+        theirs = (subst->dir == LEX_SUBST_READ ? fds[1] : fds[0]);
 
-    if (input->tch_ctrl.value == TCHCTRL_CLEAR)
-        return __prompt_output_clear(p) ? PRMT_ABRT : NULL;
+        fflush(NULL);
+        if (-1 == (pid = fork())) {
+            RMSH_SYSERR(sh);
+            close(fds[0]);
+            close(fds[1]);
+            goto out;
+        }
+        rmsh_join_job(sh, pid);
+
+        if (0 == pid) {
+            // previous substitutions must not be kept open by this one, or they would never see EOF
+            for (size_t j = 0; j < i; j++)
+                close(p->subst_fds[j]);
+            close(ours);
+            if (-1 == dup2(theirs, (subst->dir == LEX_SUBST_READ ? STDOUT_FILENO : STDIN_FILENO))) {
+                RMSH_SYSERR(sh);
+                exit(1);
+            }
+            close(theirs);
+            exit(rmsh_input(sh, subst->list) ? 1 : sh->last_exit_status);
+        }
 
-    // from here, only line mode is compatible - everything else exits and redraws entire line
+        close(theirs);
+        p->subst_pids[i] = pid;
+        p->subst_fds[i] = ours;
 
-    int moves = 0;
+        if (-1 == asprintf(&path, "/dev/fd/%d", ours)) {
+            RMSH_STRERR(sh, ENOMEM);
+            goto out;
+        }
+        if (subst->redir) {
+            free(lexp->redirs[subst->redir - 1].path);
+            lexp->redirs[subst->redir - 1].path = path;
+        }
+        else {
+            free(lexp->argv[subst->argi]);
+            lexp->argv[subst->argi] = path;
+        }
+    }
 
-    int (*fn)(struct prompt *, int *) = NULL;
+    ret = 0;
+out:
+    return ret;
+}
 
-    if      (input->tch_ctrl.value == TCHCTRL_DEL    ) fn = __prompt_output_del;
-    else if (input->tch_ctrl.value == TCHCTRL_BCKWARD) fn = __prompt_output_cursor_backward;
-    else if (input->tch_ctrl.value == TCHCTRL_FORWARD) fn = __prompt_output_cursor_forward;
-    else if (input->tch_ctrl.value == TCHCTRL_HOME   ) fn = __prompt_output_cursor_home;
-    else if (input->tch_ctrl.value == TCHCTRL_END    ) fn = __prompt_output_cursor_end;
-    else
-        return NULL; // ignore unknown control char
+/**
+ * waits for every launched process substitution of `p`.
+ */
+static void rmsh_wait_substs(struct rmsh_proc *p)
+{
+    int status;
 
-    if (!p->prmt_srch_line)
-        return (fn(p, NULL) ? PRMT_ABRT : NULL);
-    
-    if (__prompt_output_exit_search(p, &moves) || fn(p, &moves))
-        return PRMT_ABRT;
+    if (!p->subst_pids)
+        return;
     
-    __print_redrawline(p->prmt_ps1, (prompt_get(p) ?: ""), moves);
-    return NULL;
+    for (size_t i = 0; i < p->lex->nsubsts; i++) {
+        if (p->subst_pids[i] <= 0)
+            continue;
+        while (-1 == waitpid(p->subst_pids[i], &status, 0) && errno == EINTR);
+        p->subst_pids[i] = 0;
+    }
 }
 
-static const char *prompt(struct prompt *p, struct termios *termios_p)
+/**
+ * consumes ownership of `lexp` even on failure.
+ * `in_fd` and `out_fd` are the stdin and stdout of the process, `close_fd` is
+ * a pipe end which a forked builtin must not keep open (or -1).
+ * builtins run inside the shell unless `forked` is set.
+ */
+static int rmsh_launch_proc(struct rmsh *sh, struct lex_proc *lexp, int in_fd, int out_fd, int close_fd, int forked, struct rmsh_proc **out_shp)
 {
-    const char *ret = PRMT_ABRT;
-    struct termios raw_termios;
-    struct winsize winsz;
-    struct sigaction winch_act, winch_oldact;
-    int set_act = 0;
-    
-    char *ps1;
-
-    int c;
-    int moves;
-    const char *buf;
-    const char *draw_ps1;
-
-    struct __termchar termchar;
-    int termchar_ret;
-
-    prompt_winch = 1;
-
-    // set terminal to raw mode
-    memcpy(&raw_termios, termios_p, sizeof(raw_termios));
-    raw_termios.c_iflag &= ~(IXON);
-    raw_termios.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
-    ASSERT_PERROR(tcsetattr(STDIN_FILENO, TCSADRAIN, &raw_termios) == 0, "tcsetattr");
-
-    winch_act.sa_flags = SA_SIGINFO;
-    winch_act.sa_sigaction = prompt_winch_sighandler;
-    ASSERT_PERROR(sigaction(SIGWINCH, &winch_act, &winch_oldact) == 0, "sigaction");
-    set_act = 1;
+    int ret = -1;
+    struct rmsh_proc *p = NULL;
 
-retry:
-    ps1 = (getenv("PS1") ?: (getuid() ? "$ " : "# "));
-    fputs(ps1, stdout);
+    if (!(p = calloc(1, sizeof(*p)))) {
+        RMSH_STRERR(sh, ENOMEM);
+        goto out;
+    }
 
-    __prompt_reset(p, ps1);
+    p->lex = lexp;
 
-    ret = NULL;
-    while (!ret)
-    {
-        memset(&termchar, 0, sizeof(termchar));
+    if (!lexp->argv[0]) {
+        p->status = (forked ? 0 : rmsh_run_null(sh, lexp));
+        *out_shp = p;
+        ret = 0;
+        goto out;
+    }
 
-        do {
-            GETCHAR(c);
+    if ((p->builtin = rmsh_find_builtin(lexp->argv[0]))) {
+    }
+    else if (strchr(lexp->argv[0], '/')) {
+        if (!(p->filename = strdup(lexp->argv[0]))) {
+            RMSH_STRERR(sh, ENOMEM);
+            goto out;
         }
-        while (0 == (termchar_ret = __termchar_input(&termchar, c)));
-
-        if (c == '\0')
-            goto out; // EOF
+    }
+    else if ((p->filename = resolve_command_path(lexp->argv[0]))) {
+    }
+    else {
+        RMSH_ERRFMT(sh, "%s: Command not found", lexp->argv[0]);
+        p->status = 127;
+        *out_shp = p;
+        ret = 0;
+        goto out;
+    }
 
-        if (-1 == termchar_ret)
-            continue; // ignore invalid input
-        
-        // termchar_ret == 1
+    if (0 != rmsh_launch_substs(sh, p))
+        goto out;
 
-        ret = __prompt_output(p, &termchar);
+    if (p->builtin && !forked) {
+        p->status = rmsh_run_builtin(sh, p);
+    }
+    else if (p->builtin) {
+        if (-1 == (p->pid = rmsh_fork(sh, in_fd, out_fd)))
+            goto out;
+        if (0 == p->pid) {
+            if (close_fd != -1)
+                close(close_fd);
+            if (0 != rmsh_apply_redirs(sh, lexp, NULL))
+                _exit(1);
+            for (size_t i = 0; i < lexp->nassigns; i++)
+                rmsh_var_assign(sh, lexp->assigns[i]);
+            int status = p->builtin->fn(sh, argc_of(lexp->argv), lexp->argv);
+            fflush(stdout);
+            _exit(status);
+        }
     }
+    else if (-1 == (p->pid = rmsh_exec(sh, p->filename, lexp, in_fd, out_fd)))
+        goto out;
+    
+    // the pipes now belong to the launched process
+    rmsh_proc_close_substs(p);
 
+    *out_shp = p;
+    ret = 0;
 out:
-    if (set_act)
-        sigaction(SIGWINCH, &winch_oldact, NULL);
-    tcsetattr(STDIN_FILENO, TCSADRAIN, termios_p);
+    if (ret && p) {
+        rmsh_proc_close_substs(p);
+        rmsh_wait_substs(p);
+        free_rmsh_proc(p);
+    }
     return ret;
 }
 
-///////
-// Lex
-///////
-
-static const char *IFS = " \t\n";
+/**
+ * hands the terminal to the job, with the modes the shell was started with, and continues whatever of it
+ * stopped going for the terminal before then. what the prompt read past the end of the line is put back
+ * in the terminal as far as the kernel allows (TIOCSTI may be disabled), the rest stays for the next prompt.
+ */
+static void rmsh_tty_give(struct rmsh *sh)
+{
+    struct rmsh_tty *tty = sh->tty;
+    struct prompt_input *in = tty->input;
+    size_t pushed = 0;
 
-struct lex {
-    const char *shname;
-};
+    if (tty->given)
+        return;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, tty->termios);
+    tcsetpgrp(STDIN_FILENO, sh->job_pgid);
 
-struct lex_proc {
-    char **argv;
-};
+    while (in->head + pushed < in->tail && 0 == ioctl(STDIN_FILENO, TIOCSTI, &in->buf[(in->head + pushed) % PRMT_INPUT_SZ]))
+        pushed++;
+    in->head += pushed;
 
-static void free_lex_proc(struct lex_proc *p) {
+    kill(-sh->job_pgid, SIGCONT);
+    tty->given = 1;
+    tty->stopped = 0;
+}
 
-    if (p->argv) {
-        for (char **arg = p->argv; *arg; arg++)
-            free(*arg);
-        free(p->argv);
-    }
+/**
+ * takes the terminal back from the job. it's done from the background, so SIGTTOU is held off meanwhile.
+ */
+static void rmsh_tty_take(struct rmsh *sh)
+{
+    struct rmsh_tty *tty = sh->tty;
+    sigset_t ttou, old;
 
-    free(p);
+    if (!tty->given)
+        return;
+    sigemptyset(&ttou);
+    sigaddset(&ttou, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &ttou, &old);
+    tcsetpgrp(STDIN_FILENO, tty->pgid);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    tty->given = 0;
 }
 
-#define LEX_ERR(Lex, Fmt, ...) printf("%s: " Fmt, (Lex)->shname, ##__VA_ARGS__)
+/**
+ * process `pid` of the job with the terminal was stopped by `sig`.
+ * one that went for the terminal before it was handed over is continued, and 0 returned.
+ * otherwise the job was suspended (^Z). there's no job control to resume it later, so it's left stopped
+ * and not waited for anymore, the terminal is taken back to tell how to continue it, and 1 returned.
+ */
+static int rmsh_tty_stopped(struct rmsh *sh, pid_t pid, int sig)
+{
+    struct rmsh_tty *tty = sh->tty;
+
+    if (sig == SIGTTIN || sig == SIGTTOU) {
+        kill(pid, SIGCONT);
+        return 0;
+    }
+    if (!tty->stopped) {
+        rmsh_tty_take(sh);
+        RMSH_ERRFMT(sh, "%d: stopped (no job control, kill -CONT -%d continues it)", (int)pid, (int)sh->job_pgid);
+    }
+    tty->stopped = sig;
+    return 1;
+}
 
-static int lex_parse_token(struct lex *lex, const char *input, char **out, const char **endp)
+/**
+ * waits for `p` and returns its exit status, or -1 on error.
+ * while the job has the terminal its stops are waited for too, see rmsh_tty_stopped().
+ * the processes of a suspended job are given up on, with the stop signal for status.
+ */
+static int rmsh_wait_proc(struct rmsh *sh, struct rmsh_proc *p)
 {
-    int ret = -1;
-    int done_ifs = 0;
-    const char *curr;
+    int flags = (sh->tty && sh->tty->given ? WUNTRACED : 0);
+    int status;
 
-    char  *tok = NULL;
-    size_t n_tok = 0;
+    if (sh->tty && sh->tty->stopped) {
+        for (size_t i = 0; p->subst_pids && i < p->lex->nsubsts; i++)
+            p->subst_pids[i] = 0;
+        if (p->pid)
+            p->status = 128 + sh->tty->stopped;
+        p->pid = 0;
+    }
+
+    rmsh_wait_substs(p);
 
-    for (curr = input; *curr; curr++) {
-        // IFS: skip if not parsed any non-IFS, break after parsing IFS
-        if (strchr(IFS, *curr)) {
-            if (!done_ifs)
+    if (!p->pid)
+        return p->status;
+
+    while (1) {
+        if (p->pid != waitpid(p->pid, &status, flags)) {
+            if (errno == EINTR)
                 continue;
+            RMSH_SYSERR(sh);
+            return -1;
+        }
+        if (!WIFSTOPPED(status))
             break;
+        if (rmsh_tty_stopped(sh, p->pid, WSTOPSIG(status))) {
+            p->pid = 0;
+            return (p->status = 128 + WSTOPSIG(status));
         }
-
-        done_ifs = 1;
-
-        if (!(tok = realloc(tok, n_tok + 1)))
-            goto out;
-        tok[n_tok] = *curr;
-        n_tok++;
     }
+    p->pid = 0;
+    return (p->status = (WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status)));
+}
 
-    if (endp)
-        *endp = curr;
-    if (out)
-        *out = tok;
-    ret = 0;
-out:
-    if (ret) {
-        if (tok)
-            free(tok);
-    }
-    return ret;
+/**
+ * reaps `*pid` if it's done, setting it to 0. stops are dealt with by rmsh_tty_stopped().
+ * returns 1 if the job was suspended, 0 otherwise and -1 on error.
+ */
+static int rmsh_tty_reap(struct rmsh *sh, pid_t *pid, int *out_status)
+{
+    int status;
+    pid_t r;
+
+    if (*pid <= 0)
+        return 0;
+    while (-1 == (r = waitpid(*pid, &status, WNOHANG | WUNTRACED)) && errno == EINTR);
+    if (r <= 0)
+        return r;
+
+    if (WIFSTOPPED(status))
+        return rmsh_tty_stopped(sh, *pid, WSTOPSIG(status));
+    *pid = 0;
+    if (out_status)
+        *out_status = (WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    return 0;
 }
 
-static int lex_parse_proc(struct lex *lex, const char *input, struct lex_proc **outp, const char **endp)
+/**
+ * hands the terminal to the job launched by the shell and waits for it, reaping the processes that are done
+ * (their pid set to 0 and their status kept). what's typed meanwhile is the job's to read, what it leaves
+ * stays in the terminal and is read by the next prompt once the job is done or suspended.
+ * returns 0 on success and -1 on error.
+ */
+static int rmsh_wait_job(struct rmsh *sh, struct rmsh_proc *procs)
 {
-    int ret = -1;
-    size_t nargv;
-    struct lex_proc *p = NULL;
+    struct prompt_loop loop;
+    int ret = -1, stopped = 0, alive, r = 0, ev = PRMT_EV_CHLD;
 
-    if (!(p = calloc(1, sizeof(*p))))
-        goto out;
-    
-    nargv = 1;
-    if (!(p->argv = calloc(nargv, sizeof(char *))))
+    // SIGCHLD is taken by the loop from here, so an exit can't slip in between the checks and the wait
+    if (prompt_loop_open(&loop)) {
+        RMSH_SYSERR(sh);
+        rmsh_tty_give(sh);
+        return -1;
+    }
+    rmsh_tty_give(sh);
+    if (prompt_loop_input(&loop, 0))
         goto out;
 
-    while (*input) {
-        char *tok;
-        if (0 != lex_parse_token(lex, input, &tok, &input))
+    while (1) {
+        // an interrupt from outside is the job's, like ^C typed
+        if ((ev & PRMT_EV_INT) && -1 == kill(-sh->job_pgid, SIGINT) && errno != ESRCH)
             goto out;
 
-        if (!(p->argv = realloc(p->argv, (nargv + 1) * sizeof(char *))))
+        alive = 0;
+        for (struct rmsh_proc *p = procs; (ev & PRMT_EV_CHLD) && p && !stopped; p = p->next) {
+            for (size_t i = 0; p->subst_pids && i < p->lex->nsubsts && !stopped; i++) {
+                if (-1 == (r = rmsh_tty_reap(sh, &p->subst_pids[i], NULL)))
+                    goto out;
+                stopped = r;
+                alive += (p->subst_pids[i] > 0);
+            }
+            if (-1 == (r = rmsh_tty_reap(sh, &p->pid, &p->status)))
+                goto out;
+            stopped |= r;
+            alive += (p->pid > 0);
+        }
+        // the rest of a suspended job is left for rmsh_wait_proc() to give up on
+        if (stopped || ((ev & PRMT_EV_CHLD) && !alive))
+            break;
+
+        if (-1 == (ev = prompt_loop_wait(&loop)))
             goto out;
-        
-        p->argv[nargv - 1] = tok;
-        p->argv[nargv] = NULL;
-        nargv++;
     }
-
-    if (endp)
-        *endp = input;
-    *outp = p;
     ret = 0;
 out:
     if (ret)
-        free_lex_proc(p);
+        RMSH_SYSERR(sh);
+    prompt_loop_close(&loop);
     return ret;
 }
 
 /////////////
-// Interpreter
+// Pipestat
 /////////////
 
+#define PIPESTAT_POLL_MS     5  // exit detection, bounds the error of the wall time
+#define PIPESTAT_INTERVAL_MS 50 // i/o sampling
+
 /**
- * TODO:
- * . simple commands
- * . pipelines
- * . lists
- * .. && ||
- * .. ; <newline>
- * . compound commands
- * .. (list)
- * .. { list; }
- * .. ((expression))
- * .. [[ expression ]]
- * . quotes
- * . parameters
- * . special parameters
- * . arrays
- * . expansion
- * .. brace
- * .. tilde
- * .. parameter
- * .. command substitution
- * .. arithmetic
- * .. word splitting
- * .. pathname
- * .. pattern matching
- * . aliases
- * . functions
- * 
+ * per-stage profile of a pipeline launched with `pipestat`.
  */
-
-struct rmsh {
-    const char *shname;
-    int last_exit_status;
+struct pipestat_stage {
+    pid_t pid;
+    struct timespec start;
+    struct timespec end;
+    struct rusage ru;
+    int done;
+
+    // i/o counters from /proc/<pid>/io, including pipes but not splice(2)
+    int have_io;
+    unsigned long long rchar;
+    unsigned long long wchar;
+
+    // last sample, to compute the peak rate between samples
+    struct timespec sampled;
+    double peak_rbps;
+    double peak_wbps;
 };
 
-#define RMSH_STRERR(Sh, Errno) fprintf(stderr, "%s: %s\n", (Sh)->shname, strerror(Errno))
-#define RMSH_SYSERR(Sh) RMSH_STRERR((Sh), errno)
-
-#define RMSH_ERRMSG(Sh, Msg) fprintf(stderr, "%s: %s\n", (Sh)->shname, (Msg))
-#define RMSH_STRERRMSG(Sh, Errno, Msg) fprintf(stderr, "%s: %s: %s\n", (Sh)->shname, (Msg), strerror(Errno))
-#define RMSH_SYSERRMSG(Sh, Msg) RMSH_STRERRMSG((Sh), errno, (Msg))
+static double timespec_sec(const struct timespec *ts)
+{
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
 
-#define RMSH_ERRFMT(Sh, Fmt, ...) fprintf(stderr, "%s: " Fmt "\n", (Sh)->shname, ##__VA_ARGS__)
-#define RMSH_STRERRFMT(Sh, Errno, Fmt, ...) fprintf(stderr, "%s: " Fmt ": %s\n", (Sh)->shname, ##__VA_ARGS__, strerror(Errno))
-#define RMSH_SYSERRFMT(Sh, Fmt, ...) RMSH_STRERRFMT((Sh), errno, Fmt, ##__VA_ARGS__)
+static double timespec_diff(const struct timespec *end, const struct timespec *start)
+{
+    return timespec_sec(end) - timespec_sec(start);
+}
 
-static int rmsh_open(const char *shname, struct rmsh *out_sh)
+static double timeval_sec(const struct timeval *tv)
 {
-    memset(out_sh, 0, sizeof(*out_sh));
-    out_sh->shname = shname;
-    out_sh->last_exit_status = 0;
-    return 0;
+    return tv->tv_sec + tv->tv_usec / 1e6;
 }
 
-static void rmsh_close(struct rmsh *sh)
+/**
+ * returns 0 on success and -1 if the counters are not available.
+ */
+static int pipestat_read_io(pid_t pid, unsigned long long *rchar, unsigned long long *wchar)
 {
+#ifdef __linux__
+    char path[64];
+    char line[128];
+    int found = 0;
+    FILE *f;
 
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    if (!(f = fopen(path, "re")))
+        return -1;
+
+    while (found != 3 && fgets(line, sizeof(line), f)) {
+        if (1 == sscanf(line, "rchar: %llu", rchar))
+            found |= 1;
+        else if (1 == sscanf(line, "wchar: %llu", wchar))
+            found |= 2;
+    }
+
+    fclose(f);
+    return (found == 3 ? 0 : -1);
+#else
+    return -1;
+#endif
 }
 
-struct rmsh_proc {
-    struct rmsh_proc *next;
-    struct lex_proc *lex;
-    char *filename;
-    pid_t pid;
-};
+static void pipestat_sample(pid_t pid, struct pipestat_stage *stage, const struct timespec *now)
+{
+    unsigned long long rchar, wchar;
+    double elapsed;
 
-static void free_rmsh_proc(struct rmsh_proc *p) {
-    if (p->filename)
-        free(p->filename);
-    if (p->lex)
-        free_lex_proc(p->lex);
-    free(p);
+    if (0 != pipestat_read_io(pid, &rchar, &wchar))
+        return;
+
+    elapsed = timespec_diff(now, (stage->have_io ? &stage->sampled : &stage->start));
+    if (elapsed > 0) {
+        double rbps = (rchar - (stage->have_io ? stage->rchar : 0)) / elapsed;
+        double wbps = (wchar - (stage->have_io ? stage->wchar : 0)) / elapsed;
+        if (rbps > stage->peak_rbps)
+            stage->peak_rbps = rbps;
+        if (wbps > stage->peak_wbps)
+            stage->peak_wbps = wbps;
+    }
+
+    stage->have_io = 1;
+    stage->rchar = rchar;
+    stage->wchar = wchar;
+    stage->sampled = *now;
 }
 
 /**
- * may return success and `out_filepath` NULL if not found in path
+ * waits for every stage while sampling its i/o counters.
+ * exited stages are sampled once more before being reaped (with wait4() for their rusage),
+ * so the counters are final.
+ * returns 0 on success and -1 on failure.
  */
-static int rmsh_resolve_program(struct rmsh *sh, const char *filename, char **out_filepath)
+static int pipestat_wait(struct rmsh *sh, struct rmsh_proc *procs, struct pipestat_stage *stages)
 {
-    int ret = -1;
-    char *filepath;
+    size_t alive = 0;
+    struct rmsh_proc *p;
+    struct pipestat_stage *stage;
 
-    // if seperator in name, just use that file
-    if (strchr(filename, '/')) {
-        if (!(filepath = strdup(filename))) {
-            RMSH_STRERR(sh, ENOMEM);
-            goto out;
+    for (p = procs; p; p = p->next)
+        alive += (p->pid > 0);
+
+    while (alive) {
+        struct timespec now;
+        struct timespec interval = {.tv_sec = 0, .tv_nsec = PIPESTAT_POLL_MS * 1000000L};
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        for (p = procs, stage = stages; p; p = p->next, stage++) {
+            siginfo_t si;
+            int status;
+
+            if (p->pid <= 0 || stage->done)
+                continue;
+
+            memset(&si, 0, sizeof(si));
+            if (-1 == waitid(P_PID, p->pid, &si, WEXITED | WNOHANG | WNOWAIT | (sh->tty && sh->tty->given ? WSTOPPED : 0))) {
+                if (errno == EINTR)
+                    continue;
+                RMSH_SYSERR(sh);
+                return -1;
+            }
+
+            // the stop is consumed before continuing, or it'd be seen again
+            if (si.si_pid == p->pid && si.si_code == CLD_STOPPED) {
+                waitpid(p->pid, &status, WUNTRACED | WNOHANG);
+                if (!rmsh_tty_stopped(sh, p->pid, si.si_status))
+                    continue;
+
+                // suspended, what ran until then is reported
+                for (p = procs, stage = stages; p; p = p->next, stage++)
+                    if (!stage->done) {
+                        stage->end = now;
+                        stage->done = 1;
+                    }
+                return 0;
+            }
+
+            if (si.si_pid != p->pid) {
+                // still running
+                if (!stage->have_io || timespec_diff(&now, &stage->sampled) * 1000 >= PIPESTAT_INTERVAL_MS)
+                    pipestat_sample(p->pid, stage, &now);
+                continue;
+            }
+
+            // a zombie still has its counters
+            pipestat_sample(p->pid, stage, &now);
+
+            while (p->pid != wait4(p->pid, &status, 0, &stage->ru)) {
+                if (errno == EINTR)
+                    continue;
+                RMSH_SYSERR(sh);
+                return -1;
+            }
+            p->status = (WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+            p->pid = 0;
+            stage->end = now;
+            stage->done = 1;
+            alive--;
         }
 
-        *out_filepath = filepath;
-        ret = 0;
-        goto out;
+        if (alive)
+            nanosleep(&interval, NULL);
     }
 
-    struct stat st;
-    char *path = getenv("PATH");
-    if (!path)
-        goto out;
+    return 0;
+}
 
-    ret = 0;
-out:
-    return ret;
+static const char *pipestat_fmt_bytes(char *buf, size_t n, double bytes, const char *suffix)
+{
+    static const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    size_t unit = 0;
+    while (bytes >= 1024 && unit + 1 < sizeof(units) / sizeof(*units)) {
+        bytes /= 1024;
+        unit++;
+    }
+    snprintf(buf, n, (unit ? "%.1f%s%s" : "%.0f%s%s"), bytes, units[unit], suffix);
+    return buf;
 }
 
 /**
- * returns pid or -1 on error;
+ * prints the profile of every stage to stderr, marking the busiest one as the bottleneck.
  */
-static pid_t rmsh_exec(const char *shname, const char *filename, char **argv)
+static void pipestat_report(struct rmsh *sh, struct rmsh_proc *procs, struct pipestat_stage *stages, const struct timespec *start)
 {
-    pid_t ret = -1;
-    pid_t pid;
-
-    if (-1 == (pid = fork())) {
-        fprintf(stderr, "%s: %s\n", shname, strerror(errno));
-        goto out;
+    struct timespec now;
+    struct rmsh_proc *p;
+    struct pipestat_stage *stage;
+    size_t nstages = 0;
+    size_t bottleneck = 0;
+    double bottleneck_cpu = -1;
+    size_t i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (p = procs, stage = stages, i = 1; p; p = p->next, stage++, i++) {
+        double wall = timespec_diff(&stage->end, &stage->start);
+        double cpu = timeval_sec(&stage->ru.ru_utime) + timeval_sec(&stage->ru.ru_stime);
+        if (stage->done && wall > 0 && cpu / wall > bottleneck_cpu) {
+            bottleneck_cpu = cpu / wall;
+            bottleneck = i;
+        }
+        nstages++;
     }
 
-    if (0 == pid) {
-        execv(filename, argv);
-        fprintf(stderr, "%s: %s: %s\n", shname, filename, strerror(errno));
-        exit(1);
+    fprintf(stderr, "%s: pipestat: %zu stage%s in %.3fs\n", sh->shname, nstages, (nstages == 1 ? "" : "s"), timespec_diff(&now, start));
+    fprintf(stderr, "  %-5s %7s %8s %8s %8s %6s %10s %12s %12s %10s %12s %12s  %s\n",
+            "stage", "pid", "wall", "user", "sys", "cpu", "read", "read/s", "peak r/s", "write", "write/s", "peak w/s", "command");
+
+    for (p = procs, stage = stages, i = 1; p; p = p->next, stage++, i++) {
+        char rbuf[32], rsbuf[32], prbuf[32], wbuf[32], wsbuf[32], pwbuf[32];
+        double wall = timespec_diff(&stage->end, &stage->start);
+        double user = timeval_sec(&stage->ru.ru_utime);
+        double sys  = timeval_sec(&stage->ru.ru_stime);
+        const char *cmd = (p->lex->argv[0] ?: "");
+
+        // builtins which ran inside the shell, or stages which failed to launch
+        if (!stage->done) {
+            fprintf(stderr, "  %-5zu %7s %8s %8s %8s %6s %10s %12s %12s %10s %12s %12s  %s\n",
+                    i, "-", "-", "-", "-", "-", "-", "-", "-", "-", "-", "-", cmd);
+            continue;
+        }
+
+        if (stage->have_io) {
+            pipestat_fmt_bytes(rbuf, sizeof(rbuf), stage->rchar, "");
+            pipestat_fmt_bytes(rsbuf, sizeof(rsbuf), (wall > 0 ? stage->rchar / wall : 0), "/s");
+            pipestat_fmt_bytes(prbuf, sizeof(prbuf), stage->peak_rbps, "/s");
+            pipestat_fmt_bytes(wbuf, sizeof(wbuf), stage->wchar, "");
+            pipestat_fmt_bytes(wsbuf, sizeof(wsbuf), (wall > 0 ? stage->wchar / wall : 0), "/s");
+            pipestat_fmt_bytes(pwbuf, sizeof(pwbuf), stage->peak_wbps, "/s");
+        }
+        else {
+            strcpy(rbuf, "-");
+            strcpy(rsbuf, "-");
+            strcpy(prbuf, "-");
+            strcpy(wbuf, "-");
+            strcpy(wsbuf, "-");
+            strcpy(pwbuf, "-");
+        }
+
+        fprintf(stderr, "%c %-5zu %7d %7.3fs %7.3fs %7.3fs %5.1f%% %10s %12s %12s %10s %12s %12s  %s\n",
+                (i == bottleneck && nstages > 1 ? '*' : ' '), i, (int)stage->pid,
+                wall, user, sys, (wall > 0 ? 100 * (user + sys) / wall : 0.0),
+                rbuf, rsbuf, prbuf, wbuf, wsbuf, pwbuf, cmd);
     }
 
-    ret = pid;
-out:
-    return ret;
+    if (bottleneck && nstages > 1)
+        fprintf(stderr, "%s: pipestat: bottleneck is stage %zu (%.1f%% cpu)\n", sh->shname, bottleneck, 100 * bottleneck_cpu);
 }
 
 /**
- * consumes ownership of `lexp` even on failure
+ * consumes ownership of `pl` even on failure.
  */
-static int rmsh_launch_proc(struct rmsh *sh, struct lex_proc *lexp, struct rmsh_proc **out_shp)
+static int rmsh_run_pipeline(struct rmsh *sh, struct lex_pipeline *pl)
 {
     int ret = -1;
-    struct rmsh_proc *p = NULL;
-
-    if (!(p = calloc(1, sizeof(*p)))) {
-        RMSH_STRERR(sh, ENOMEM);
-        goto out;
+    struct rmsh_proc *procs = NULL;
+    struct rmsh_proc **tail = &procs;
+    struct rmsh_proc *shp;
+    int in_fd = STDIN_FILENO;
+    int failed = 0;
+    struct pipestat_stage *stages = NULL;
+    struct timespec start;
+
+    if (pl->pipestat && pl->nprocs) {
+        if (!(stages = calloc(pl->nprocs, sizeof(*stages)))) {
+            RMSH_STRERR(sh, ENOMEM);
+            free_lex_pipeline(pl);
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
     }
 
-    p->lex = lexp;
+    // each process reads from the pipe of the previous one and writes to the pipe of the next one
+    for (size_t i = 0; i < pl->nprocs; i++) {
+        int fds[2] = {-1, -1};
+        int launched;
 
-    if (strchr(lexp->argv[0], '/')) {
-        if (!(p->filename = strdup(lexp->argv[0]))) {
-            RMSH_STRERR(sh, ENOMEM);
-            goto out;
+        if (i + 1 < pl->nprocs && 0 != rmsh_pipe(sh, fds)) {
+            failed = 1;
+            break;
+        }
+
+        if (stages)
+            clock_gettime(CLOCK_MONOTONIC, &stages[i].start);
+
+        launched = rmsh_launch_proc(sh, pl->procs[i], in_fd, (fds[1] != -1 ? fds[1] : STDOUT_FILENO), fds[0], (pl->nprocs > 1), &shp);
+        pl->procs[i] = NULL; // consumed
+
+        if (stages && 0 == launched)
+            stages[i].pid = shp->pid;
+
+        if (in_fd != STDIN_FILENO)
+            close(in_fd);
+        if (fds[1] != -1)
+            close(fds[1]);
+        in_fd = fds[0];
+
+        if (0 != launched) {
+            failed = 1;
+            break;
         }
+        *tail = shp;
+        tail = &shp->next;
     }
-    else if ((p->filename = resolve_command_path(lexp->argv[0]))) {
+    if (in_fd != STDIN_FILENO)
+        close(in_fd);
+
+    // wait even for partially launched pipelines
+    ret = (failed ? -1 : 0);
+    if (sh->tty && sh->job_pgid) {
+        // pipestat samples on its own schedule, so the job gets the terminal right away
+        if (stages)
+            rmsh_tty_give(sh);
+        else if (0 != rmsh_wait_job(sh, procs))
+            ret = -1;
     }
-    else {
-        RMSH_ERRFMT(sh, "%s: Command not found", lexp->argv[0]);
-        *out_shp = NULL;
-        free_rmsh_proc(p);
-        ret = 0;
-        goto out;
+    if (stages && 0 != pipestat_wait(sh, procs, stages))
+        ret = -1;
+    for (shp = procs; shp; shp = shp->next) {
+        int status = rmsh_wait_proc(sh, shp);
+        if (status == -1)
+            ret = -1;
+        else
+            sh->last_exit_status = status;
     }
+    if (sh->tty)
+        rmsh_tty_take(sh);
+    sh->job_pgid = 0;
 
-    if (-1 == (p->pid = rmsh_exec(sh->shname, p->filename, p->lex->argv)))
-        goto out;
-    
-    *out_shp = p;
-    ret = 0;
-out:
-    if (ret)
-        free_rmsh_proc(p);
+    if (stages) {
+        pipestat_report(sh, procs, stages, &start);
+        free(stages);
+    }
+
+    while (procs) {
+        shp = procs->next;
+        free_rmsh_proc(procs);
+        procs = shp;
+    }
+    free_lex_pipeline(pl);
     return ret;
 }
 
+/**
+ * runs a list of pipelines separated by `;` or newlines.
+ * every pipeline is parsed right before it runs, so it sees parameters set by the previous ones.
+ */
 static int rmsh_input(struct rmsh *sh, const char *input)
 {
-    int ret = -1;
-    int status;
-    struct lex lex = {.shname = sh->shname};
-    struct lex_proc *lexp = NULL;
-    struct rmsh_proc *shp = NULL;
+    struct lex lex = {.shname = sh->shname, .lookup = rmsh_lookup, .lookup_ctx = sh};
+    struct lex_pipeline *pl;
 
-    if (0 != lex_parse_proc(&lex, input, &lexp, &input))
-        goto out;
+    while (1) {
+        if (0 != lex_parse_pipeline(&lex, input, &pl, &input)) {
+            sh->last_exit_status = 2; // syntax error, keep the shell running
+            return 0;
+        }
 
-    if (0 != rmsh_launch_proc(sh, lexp, &shp))
-        goto out;
-    
-    // command not found
-    if (!shp) {
-        ret = 0;
-        goto out;
-    }
+        if (0 != rmsh_run_pipeline(sh, pl))
+            return -1;
 
-    if (shp->pid != waitpid(shp->pid, &status, 0)) {
-        RMSH_SYSERR(sh);
-        goto out;
+        if (!*input)
+            break;
+        input++; // skip `;` or newline
     }
 
-    ret = 0;
-out:
-    return ret;
+    return 0;
 }
 
 /////////////
 // Main
 /////////////
 
-static int interactive(const char *shname, int debug_input) {
+/**
+ * replays the input recorded in `path` with `-D -k` through the line editor on a virtual terminal
+ * of $LINES by $COLUMNS (24 by 80 by default), and prints the counters of the prompt.
+ * fails if a frame leaves the screen different from what the prompt expects.
+ */
+static int replay(const char *path)
+{
+    int ret = 1, fd = -1, null = -1;
+    struct stat st;
+    unsigned char *buf = MAP_FAILED;
+    struct prompt prmt = {0};
+    struct vt vt = {0};
+    const char *rows = getenv("LINES"), *cols = getenv("COLUMNS");
+    ssize_t bad;
+
+    ASSERT_PERROR(-1 != (fd = open(path, O_RDONLY | O_CLOEXEC)), path);
+    ASSERT_PERROR(0 == fstat(fd, &st), path);
+    if (st.st_size)
+        ASSERT_PERROR(MAP_FAILED != (buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)), path);
+    ASSERT_PERROR(-1 != (null = open("/dev/null", O_WRONLY | O_CLOEXEC)), "/dev/null");
+    ASSERT_PERROR(0 == vt_open(&vt, (rows && atoi(rows) > 0 ? atoi(rows) : 24), (cols && atoi(cols) > 0 ? atoi(cols) : 80)), "vt_open");
+
+    ASSERT_PERROR(-1 != (bad = prompt_replay(&prmt, (getenv("PS1") ?: "$ "), &vt, buf, st.st_size, null)), "prompt_replay");
+
+    prompt_stat_print(STDOUT_FILENO, 0);
+    dprintf(STDOUT_FILENO,
+            "ns/key      %.0f\n"
+            "bad frames  %zd\n",
+            (double)prompt_stat.latency.sum / (prompt_stat.keys ? prompt_stat.keys : 1), bad);
+    ret = !!bad;
+out:
+    vt_close(&vt);
+    __prompt_reset(&prmt, NULL);
+    if (buf != MAP_FAILED)
+        munmap(buf, st.st_size);
+    if (fd != -1)
+        close(fd);
+    if (null != -1)
+        close(null);
+    return ret;
+}
+
+static int interactive(const char *shname, int debug_input, const char *keylog) {
     int ret = 1;
     struct termios termios;
     pid_t shpgid;
@@ -1543,13 +6456,16 @@ static int interactive(const char *shname, int debug_input) {
     ASSERT_PERROR(tcgetattr(STDIN_FILENO, &termios) == 0, "tcgetattr");
 
     if (debug_input) {
-        debug_prompt(&termios);
+        debug_prompt(&termios, keylog);
         goto out;
     }
     
     if (0 != rmsh_open(shname, &sh))
         goto out;
 
+    struct rmsh_tty tty = {.pgid = getpgrp(), .termios = &termios, .input = &prmt.prmt_input};
+    sh.tty = &tty;
+
     while (1) {
         const char *in = prompt(&prmt, &termios);
         if (!in)
@@ -1586,7 +6502,7 @@ static int noninteractive(const char *shname, const char *command) {
     if (0 != rmsh_input(&sh, command))
             goto out;
 
-    ret = 0;
+    ret = sh.last_exit_status;
 out:
 
     rmsh_close(&sh);
@@ -1600,7 +6516,13 @@ static void helpexit(const char *exe)
     printf("rmsh shell\n\n");
     printf("  -c COMMAND     run a single command and exit\n");
     printf("  -D             run debug input mode\n");
+    printf("  -k FILE        with -D, also record the raw input to FILE\n");
+    printf("  -p FILE        replay input recorded with -k through the line editor and print its counters\n");
     printf("  -h             display this help and exit\n");
+    printf("\nENVIRONMENT:\n");
+    printf("  RMSH_HSCROLL   if set and not 0, long lines scroll horizontally instead of wrapping\n");
+    printf("  RMSH_ESCDELAY  ms to wait for the rest of an escape sequence before taking a lone ESC (default %d, negative waits forever)\n", PRMT_ESCDELAY);
+    printf("  XDG_CACHE_HOME where the features of each $TERM are kept once asked for (default ~/.cache), under rmsh/term-$TERM\n");
     exit(0);
 }
 
@@ -1611,6 +6533,7 @@ int main(int argc, char **argv)
 #endif
 {
     int debug_input = 0;
+    const char *keylog = NULL, *replay_path = NULL;
     const char *bname = strrchr(argv[0], '/');
     bname = (bname ? (bname + 1) : argv[0]);
 
@@ -1618,7 +6541,7 @@ int main(int argc, char **argv)
 
     int c;
     do {
-        c = getopt(argc, argv, "hc:D");\
+        c = getopt(argc, argv, "hc:Dk:p:");\
 
         if (c == 'h') {
             helpexit(bname);
@@ -1629,6 +6552,12 @@ int main(int argc, char **argv)
         else if (c == 'D') {
             debug_input = 1;
         }
+        else if (c == 'k') {
+            keylog = optarg;
+        }
+        else if (c == 'p') {
+            replay_path = optarg;
+        }
         else {
             if (c == -1) {
                 if (!argv[optind])
@@ -1643,8 +6572,11 @@ int main(int argc, char **argv)
     if (command)
         return noninteractive(bname, command);
 
+    if (replay_path)
+        return replay(replay_path);
+
     if (isatty(STDIN_FILENO))
-        return interactive(bname, debug_input);
+        return interactive(bname, debug_input, keylog);
     
     char *cmdbuf = NULL;
     size_t cmdn = 0;
@@ -1658,15 +6590,17 @@ int main(int argc, char **argv)
         }
         if (!currn)
             break;
-        if (!(cmdbuf = realloc(cmdbuf, cmdn + currn))) {
+        if (!(cmdbuf = realloc(cmdbuf, cmdn + currn + 1))) { // +1 for \0
             errno = ENOMEM;
             perror(bname);
             return 1;
         }
         memcpy(cmdbuf + cmdn, chunk, currn);
+        cmdn += currn;
+        cmdbuf[cmdn] = 0;
     }
 
-    int ret = noninteractive(bname, cmdbuf);
+    int ret = noninteractive(bname, (cmdbuf ?: ""));
     free(cmdbuf);
     return ret;
 }
\ No newline at end of file
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""
+generates wcwidth.h, the display width tables used by the prompt.
+
+widths come from the unicode database of the running python:
+  0 - combining and enclosing marks, format and control characters, hangul jamo vowels and finals
+  2 - east asian wide and fullwidth characters (including emoji presentation), cjk extension planes
+  1 - everything else
+
+the table is two-level: `wcwidth_stage1[cp >> 8]` picks a block of 256 code points and
+`wcwidth_stage2[block]` holds their widths, 2 bits each. identical blocks are shared.
+
+usage: python3 mkwcwidth.py > wcwidth.h
+"""
+
+import sys
+import unicodedata
+
+BLOCK = 256
+MAX = 0x110000
+
+
+def width(cp):
+    c = chr(cp)
+    cat = unicodedata.category(c)
+    if cp == 0xad:
+        return 1  # soft hyphen is visible
+    if cat in ('Mn', 'Me', 'Cf', 'Cc'):
+        return 0
+    if 0x1160 <= cp <= 0x11ff or 0xd7b0 <= cp <= 0xd7ff or cp == 0x200b:
+        return 0
+    if unicodedata.east_asian_width(c) in ('W', 'F'):
+        return 2
+    if 0x20000 <= cp <= 0x2fffd or 0x30000 <= cp <= 0x3fffd:
+        return 2
+    return 1
+
+
+def main():
+    blocks = {}
+    stage1 = []
+    for b in range(MAX // BLOCK):
+        widths = tuple(width(cp) for cp in range(b * BLOCK, (b + 1) * BLOCK))
+        stage1.append(blocks.setdefault(widths, len(blocks)))
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write('// generated by mkwcwidth.py from unicode %s, do not edit\n\n' % unicodedata.unidata_version)
+    out.write('#ifndef WCWIDTH_H\n#define WCWIDTH_H\n\n#include <stdint.h>\n\n')
+
+    out.write('static const uint8_t wcwidth_stage1[%d] = {\n' % len(stage1))
+    for i in range(0, len(stage1), 16):
+        out.write('    ' + ', '.join('%3d' % x for x in stage1[i:i + 16]) + ',\n')
+    out.write('};\n\n')
+
+    out.write('static const uint8_t wcwidth_stage2[%d][%d] = {\n' % (len(blocks), BLOCK // 4))
+    for widths in blocks:
+        packed = [0] * (BLOCK // 4)
+        for i, w in enumerate(widths):
+            packed[i // 4] |= w << ((i % 4) * 2)
+        out.write('    {\n')
+        for i in range(0, len(packed), 16):
+            out.write('        ' + ', '.join('0x%02x' % x for x in packed[i:i + 16]) + ',\n')
+        out.write('    },\n')
+    out.write('};\n\n#endif // WCWIDTH_H\n')
+
+
+if __name__ == '__main__':
+    main()